@@ -0,0 +1,171 @@
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BC_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * A pixel d below the maximum of a block with range r = max - min is
+ * nearest to the t'th of the eight values, counting down from the
+ * maximum, where t = round(7 * d / r), which is the number of k in
+ * 1 .. 7 with (2k - 1) * r <= 14 * d.  Counting thresholds like that
+ * vectorizes, and doesn't divide.  BC4's index for t is 0 for the
+ * maximum, 1 for the minimum, and t + 1 for the six in between.
+ */
+static void bc4_write_block(unsigned char *out, int max, int min, uint64_t bits)
+{
+	int i;
+
+	out[0] = max;
+	out[1] = min;
+	for (i = 0; i < 6; i++)
+		out[2 + i] = bits >> (8 * i);
+}
+
+void bc4_encode_block_scalar(const unsigned char *values, unsigned char *out)
+{
+	int i, k, t, max = 0, min = 255, range;
+	uint64_t bits = 0;
+
+	for (i = 0; i < 16; i++) {
+		if (values[i] > max)
+			max = values[i];
+		if (values[i] < min)
+			min = values[i];
+	}
+	range = max - min;
+	for (i = 0; i < 16; i++) {
+		t = 0;
+		for (k = 1; k <= 7; k++)
+			t += (2 * k - 1) * range <= 14 * (max - values[i]);
+		t = t == 0 ? 0 : t == 7 ? 1 : t + 1;
+		bits |= (uint64_t) t << (3 * i);
+	}
+	bc4_write_block(out, max, min, bits);
+}
+
+#ifdef BC_X86
+
+__attribute__((target("sse4.1")))
+static void bc4_encode_block_sse41(const unsigned char *values, unsigned char *out)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i fourteen = _mm_set1_epi16(14);
+	__m128i v, vmax, vmin, d, dlo, dhi, tlo, thi, thr, range, idx;
+	__m128i pairs, quads;
+	uint64_t bits;
+	int k, max, min;
+
+	v = _mm_loadu_si128((const __m128i *) values);
+
+	/* Horizontal maximum and minimum, by folding in halves */
+	vmax = _mm_max_epu8(v, _mm_srli_si128(v, 8));
+	vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 4));
+	vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 2));
+	vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 1));
+	vmin = _mm_min_epu8(v, _mm_srli_si128(v, 8));
+	vmin = _mm_min_epu8(vmin, _mm_srli_si128(vmin, 4));
+	vmin = _mm_min_epu8(vmin, _mm_srli_si128(vmin, 2));
+	vmin = _mm_min_epu8(vmin, _mm_srli_si128(vmin, 1));
+	max = _mm_cvtsi128_si32(vmax) & 0xff;
+	min = _mm_cvtsi128_si32(vmin) & 0xff;
+
+	/* 14 * (max - v), in two halves of 16-bit lanes */
+	d = _mm_subs_epu8(_mm_set1_epi8((char) max), v);
+	dlo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), fourteen);
+	dhi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), fourteen);
+
+	/* t = 7 minus the number of thresholds above 14 * d */
+	range = _mm_set1_epi16(max - min);
+	tlo = _mm_set1_epi16(7);
+	thi = tlo;
+	for (k = 1; k <= 7; k++) {
+		thr = _mm_mullo_epi16(range, _mm_set1_epi16(2 * k - 1));
+		tlo = _mm_add_epi16(tlo, _mm_cmplt_epi16(dlo, thr));
+		thi = _mm_add_epi16(thi, _mm_cmplt_epi16(dhi, thr));
+	}
+	idx = _mm_packus_epi16(tlo, thi);
+
+	/* t to BC4 index: 0 stays 0, 7 becomes 1, the rest t + 1 */
+	idx = _mm_add_epi8(idx, _mm_set1_epi8(1));
+	idx = _mm_add_epi8(idx, _mm_cmpeq_epi8(idx, _mm_set1_epi8(1)));
+	idx = _mm_sub_epi8(idx, _mm_and_si128(_mm_cmpeq_epi8(idx, _mm_set1_epi8(8)), _mm_set1_epi8(7)));
+
+	/* Pack the 3-bit indices: pairs into 6 bits, those into 12, then four of those */
+	pairs = _mm_maddubs_epi16(idx, _mm_set1_epi16(8 << 8 | 1));
+	quads = _mm_madd_epi16(pairs, _mm_set1_epi32(64 << 16 | 1));
+	bits = (uint64_t) _mm_extract_epi32(quads, 0) |
+		(uint64_t) _mm_extract_epi32(quads, 1) << 12 |
+		(uint64_t) _mm_extract_epi32(quads, 2) << 24 |
+		(uint64_t) _mm_extract_epi32(quads, 3) << 36;
+	bc4_write_block(out, max, min, bits);
+}
+
+#endif
+
+static bc4_encode_fn bc4_impl;
+static const char *bc4_impl_name;
+static pthread_once_t bc4_once = PTHREAD_ONCE_INIT;
+
+static void bc4_choose_implementation(void)
+{
+#ifdef BC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1")) {
+		bc4_impl_name = "sse4.1";
+		bc4_impl = bc4_encode_block_sse41;
+		return;
+	}
+#endif
+	bc4_impl_name = "scalar";
+	bc4_impl = bc4_encode_block_scalar;
+}
+
+void bc4_encode_block(const unsigned char *values, unsigned char *out)
+{
+	pthread_once(&bc4_once, bc4_choose_implementation);
+	bc4_impl(values, out);
+}
+
+const char *bc4_implementation(void)
+{
+	pthread_once(&bc4_once, bc4_choose_implementation);
+	return bc4_impl_name;
+}
+
+bc4_encode_fn bc4_encode_implementation(const char *name)
+{
+#ifdef BC_X86
+	__builtin_cpu_init();
+	if (strcmp(name, "sse4.1") == 0)
+		return __builtin_cpu_supports("sse4.1") ? bc4_encode_block_sse41 : NULL;
+#endif
+	if (strcmp(name, "scalar") == 0)
+		return bc4_encode_block_scalar;
+	return NULL;
+}
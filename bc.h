@@ -0,0 +1,51 @@
+#ifndef BC_H__
+#define BC_H__
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * BC4 block compression: a 4x4 block of one 8-bit channel becomes 8
+ * bytes, two endpoints and a 3-bit index per pixel into the eight values
+ * evenly spaced between them.  The endpoints are the block's maximum
+ * and minimum (in that order, which selects the eight value mode), and
+ * each pixel gets the nearest value.  BC5 is two BC4 blocks, red then
+ * green.
+ *
+ * Every implementation gives the same output, bit for bit.
+ */
+#define BC4_BLOCK_BYTES 8
+#define BC5_BLOCK_BYTES 16
+
+/* Encodes the 16 values of a block, in rows, into out */
+void bc4_encode_block(const unsigned char *values, unsigned char *out);
+
+/* The plain C version, regardless of what the cpu supports */
+void bc4_encode_block_scalar(const unsigned char *values, unsigned char *out);
+
+/* Name of the implementation bc4_encode_block() dispatches to: "sse4.1" or "scalar" */
+const char *bc4_implementation(void);
+
+typedef void (*bc4_encode_fn)(const unsigned char *values, unsigned char *out);
+
+/* The implementation called name, or NULL if this cpu can't run it, for comparing them */
+bc4_encode_fn bc4_encode_implementation(const char *name);
+
+#endif
@@ -71,3 +71,122 @@ void bline(int x1, int y1, int x2, int y2, plotting_function plot_func, void *co
 		}
 	}
 }
+
+/* Smallest integer >= n / d, for n >= 0, d > 0 */
+static long long ceil_div(long long n, long long d)
+{
+	return (n + d - 1) / d;
+}
+
+/*
+ * Bresenham's line drawing algorithm again, producing exactly the pixels
+ * bline() would, but only those inside [cx1, cx2) x [cy1, cy2), in runs.
+ *
+ * Pixel i of a line, counting from 0 at (x1, y1), is i steps along the major
+ * axis and m(i) = (2 * dmin * i + dmaj) / (2 * dmaj) steps along the minor
+ * axis, so the range of i inside the clip rectangle can be found directly:
+ * m(i) never decreases, so each clip edge cuts off a prefix or a suffix.
+ * Only that range is stepped through, starting from the error term pixel
+ * i0 would have had.
+ */
+void bline_clipped(int x1, int y1, int x2, int y2, int cx1, int cy1, int cx2, int cy2,
+			run_function run_func, void *context)
+{
+	int dmaj, dmin, a1, b1, inca, incb, amin, amax, bmin, bmax;
+	int i, i0, i1, m, start, e, inc1, inc2, vertical;
+	long long lo, hi, mlo, mhi;
+
+	if (cx1 >= cx2 || cy1 >= cy2)
+		return;
+
+	dmaj = x2 - x1;
+	if (dmaj < 0)
+		dmaj = -dmaj;
+	dmin = y2 - y1;
+	if (dmin < 0)
+		dmin = -dmin;
+
+	/* Same choice of major axis as bline() */
+	vertical = !(dmaj > dmin);
+	if (vertical) {
+		i = dmaj;
+		dmaj = dmin;
+		dmin = i;
+		a1 = y1;
+		b1 = x1;
+		inca = (y2 < y1) ? -1 : 1;
+		incb = (x2 < x1) ? -1 : 1;
+		amin = cy1;
+		amax = cy2 - 1;
+		bmin = cx1;
+		bmax = cx2 - 1;
+	} else {
+		a1 = x1;
+		b1 = y1;
+		inca = (x2 < x1) ? -1 : 1;
+		incb = (y2 < y1) ? -1 : 1;
+		amin = cx1;
+		amax = cx2 - 1;
+		bmin = cy1;
+		bmax = cy2 - 1;
+	}
+
+	/* Steps that are inside the clip rectangle along the major axis */
+	if (inca > 0) {
+		lo = (long long) amin - a1;
+		hi = (long long) amax - a1;
+	} else {
+		lo = (long long) a1 - amax;
+		hi = (long long) a1 - amin;
+	}
+	if (lo < 0)
+		lo = 0;
+	if (hi > dmaj)
+		hi = dmaj;
+
+	/* Minor axis steps that are inside, and the pixels that take them */
+	if (incb > 0) {
+		mlo = (long long) bmin - b1;
+		mhi = (long long) bmax - b1;
+	} else {
+		mlo = (long long) b1 - bmax;
+		mhi = (long long) b1 - bmin;
+	}
+	if (mhi < 0 || mlo > dmin)
+		return;
+	if (dmin == 0) {
+		if (mlo > 0)
+			return;
+	} else {
+		if (mlo > 0 && ceil_div(2LL * dmaj * mlo - dmaj, 2LL * dmin) > lo)
+			lo = ceil_div(2LL * dmaj * mlo - dmaj, 2LL * dmin);
+		if (mhi < dmin && ceil_div(2LL * dmaj * (mhi + 1) - dmaj, 2LL * dmin) - 1 < hi)
+			hi = ceil_div(2LL * dmaj * (mhi + 1) - dmaj, 2LL * dmin) - 1;
+	}
+	if (lo > hi)
+		return;
+	i0 = lo;
+	i1 = hi;
+
+	m = dmaj ? (2LL * dmin * i0 + dmaj) / (2LL * dmaj) : 0;
+	e = 2LL * dmin * (i0 + 1) - dmaj - 2LL * dmaj * m;
+	inc1 = 2 * (dmin - dmaj);
+	inc2 = 2 * dmin;
+	start = i0;
+	for (i = i0; i <= i1; i++) {
+		if (i == i1 || e >= 0) {
+			/* pixels start .. i share a minor coordinate */
+			if (vertical)
+				run_func(b1 + incb * m, a1 + inca * (inca > 0 ? start : i), i - start + 1, 1, context);
+			else
+				run_func(a1 + inca * (inca > 0 ? start : i), b1 + incb * m, i - start + 1, 0, context);
+			start = i + 1;
+		}
+		if (e >= 0) {
+			m++;
+			e += inc1;
+		} else {
+			e += inc2;
+		}
+	}
+}
@@ -24,4 +24,17 @@ typedef void (*plotting_function)(int x, int y, void *context);
 
 extern void bline(int x1, int y1, int x2, int y2, plotting_function plot_func, void *context);
 
+/*
+ * Called with len pixels in a row, starting at (x, y) and going right, or
+ * down if vertical is set.
+ */
+typedef void (*run_function)(int x, int y, int len, int vertical, void *context);
+
+/*
+ * Same pixels as bline(), but only the ones inside [cx1, cx2) x [cy1, cy2),
+ * without stepping through the rest, and handed over as runs.
+ */
+extern void bline_clipped(int x1, int y1, int x2, int y2, int cx1, int cy1, int cx2, int cy2,
+			run_function run_func, void *context);
+
 #endif
@@ -0,0 +1,1186 @@
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Golden output checks ("make check").  For a matrix of seeds, sizes and
+ * LIMIT values, the heightmap and normal map every optimized path produces
+ * (spans, tiles, threads, SIMD, accumulation, scene files, PNG) are
+ * compared byte for byte against plain reference implementations, which
+ * draw one pixel at a time exactly the way the original code did.
+ * Block compressed textures are lossy, so they're decoded and checked
+ * against the error bound of BC4 instead.
+ * The Mersenne Twister has to give the same streams it always did, which
+ * are checked against known values for a few seeds.
+ *
+ * The one approximate mode is --accumulate, which clamps heights once at the
+ * end instead of after every primitive.  It has to match its own reference
+ * (unclamped sums, clamped at the end) exactly, and the saturating
+ * reference everywhere except at no more than ACCUMULATE_TOLERANCE of the
+ * pixels, where overlapping primitives went past 0 or 255.
+ *
+ * This file includes groovygreebler.c to get at its static functions.
+ */
+#define main groovygreebler_main
+#include "groovygreebler.c"
+#undef main
+
+#include <unistd.h>
+#include <zlib.h>
+
+#include "bc.h"
+
+#define ACCUMULATE_TOLERANCE 0.001 /* fraction of pixels */
+#define CHECK_THREADS 4
+
+static const int check_seeds[] = { 1, 2, 3 };
+static const int check_sizes[] = { 300, 1024 };
+static const int check_limits[] = { 16, 32, 64 };
+
+#define ARRAY_SIZE(a) ((int) (sizeof(a) / sizeof((a)[0])))
+
+static int nchecks, nfailures;
+static char case_name[100];
+
+/*
+ * Counts the pixels of two dim x dim images with bpp bytes per pixel that
+ * differ, and fails if there are more than allowed, printing the first.
+ */
+static void compare_images(const char *what, const unsigned char *expected, const unsigned char *got,
+				int dim, int bpp, long allowed)
+{
+	long i, n = (long) dim * dim, first = -1, ndiff = 0;
+	int k;
+
+	nchecks++;
+	for (i = 0; i < n; i++) {
+		if (memcmp(&expected[i * bpp], &got[i * bpp], bpp) == 0)
+			continue;
+		if (first < 0)
+			first = i;
+		ndiff++;
+	}
+	if (ndiff <= allowed)
+		return;
+	nfailures++;
+	printf("FAIL %s: %s: %ld pixels differ, first at (%ld, %ld), expected",
+		case_name, what, ndiff, first % dim, first / dim);
+	for (k = 0; k < bpp; k++)
+		printf(" %d", expected[first * bpp + k]);
+	printf(", got");
+	for (k = 0; k < bpp; k++)
+		printf(" %d", got[first * bpp + k]);
+	printf("\n");
+}
+
+/*
+ * The reference rasterizer.  Every primitive is drawn a pixel at a time,
+ * clipped per pixel.  With sum set, heights are added up without clamping
+ * instead, which is what accumulation mode should produce before its final
+ * clamp.
+ */
+struct reference_canvas {
+	unsigned char *heightmap;
+	int *sum;
+	int dim;
+	int clipx1, clipy1, clipx2, clipy2;
+};
+
+static void reference_set_height(struct reference_canvas *c, int x, int y, int h)
+{
+	size_t p;
+	int n;
+
+	if (x < c->clipx1 || x >= c->clipx2 || y < c->clipy1 || y >= c->clipy2)
+		return;
+	p = (size_t) y * c->dim + x;
+	if (c->sum) {
+		c->sum[p] += h;
+		return;
+	}
+	n = c->heightmap[p] + h;
+	if (n < 0)
+		n = 0;
+	else if (n > 255)
+		n = 255;
+	c->heightmap[p] = n;
+}
+
+static void reference_groove(struct reference_canvas *c, int x, int y, int len, int dir, int in_or_out)
+{
+	int i;
+
+	x -= (len / 2) * xo[dir];
+	y -= (len / 2) * yo[dir];
+	for (i = 0; i < len; i++) {
+		reference_set_height(c, x, y, in_or_out * 30);
+		reference_set_height(c, x + yo[dir], y + xo[dir], in_or_out * 15);
+		reference_set_height(c, x - yo[dir], y - xo[dir], in_or_out * 15);
+		x += xo[dir];
+		y += yo[dir];
+	}
+}
+
+static void reference_rectangle(struct reference_canvas *c, int x, int y, int width, int height,
+				int in_or_out)
+{
+	int i, j, lox, hix, loy, hiy;
+
+	lox = x - width / 2;
+	hix = x + width / 2;
+	loy = y - height / 2;
+	hiy = y + height / 2;
+	for (i = lox + 1; i < hix - 1; i++)
+		for (j = loy + 1; j < hiy - 1; j++)
+			reference_set_height(c, i, j, in_or_out * 30);
+	for (i = lox; i < hix; i++) {
+		reference_set_height(c, i, loy, in_or_out * 15);
+		reference_set_height(c, i, hiy, in_or_out * 15);
+	}
+	for (i = loy; i < hiy; i++) {
+		reference_set_height(c, lox, i, in_or_out * 15);
+		reference_set_height(c, hix, i, in_or_out * 15);
+	}
+}
+
+static void reference_circle(struct reference_canvas *c, int x, int y, int radius, int in_or_out)
+{
+	int i, j;
+
+	for (i = x - radius + 1; i < x + radius - 1; i++)
+		for (j = y - radius + 1; j < y + radius - 1; j++)
+			if ((x - i) * (x - i) + (y - j) * (y - j) < radius * radius)
+				reference_set_height(c, i, j, in_or_out * 20);
+}
+
+struct reference_plot {
+	struct reference_canvas *c;
+	int h;
+};
+
+static void reference_plot_point(int x, int y, void *context)
+{
+	struct reference_plot *rp = context;
+
+	reference_set_height(rp->c, x, y, rp->h);
+}
+
+static void reference_annulus_sector(struct reference_canvas *c, int x, int y,
+				float a1, float a2, int r1, int r2, int in_or_out)
+{
+	struct reference_plot rp = { c, in_or_out * 20 };
+	int x1, y1, x2, y2, x3, y3, x4, y4;
+
+	x1 = x + cos(a1) * r1;
+	y1 = y - sin(a1) * r1;
+	x2 = x + cos(a1) * r2;
+	y2 = y - sin(a1) * r2;
+	x3 = x + cos(a2) * r1;
+	y3 = y - sin(a2) * r1;
+	x4 = x + cos(a2) * r2;
+	y4 = y - sin(a2) * r2;
+	bline(x1, y1, x2, y2, reference_plot_point, &rp);
+	bline(x2, y2, x4, y4, reference_plot_point, &rp);
+	bline(x4, y4, x3, y3, reference_plot_point, &rp);
+	bline(x3, y3, x1, y1, reference_plot_point, &rp);
+}
+
+/* Whether (px, py), relative to the centre with y up, is on or left of the ray at angle a */
+static int reference_left_of_ray(float a, int px, int py)
+{
+	double s = sin(a), c = cos(a), t;
+
+	if (s == 0.0)
+		return c * py >= 0.0;
+	t = c * py / s;
+	return s > 0.0 ? px <= t : px >= t;
+}
+
+static int reference_in_sector(float a1, float a2, int px, int py)
+{
+	int left_of_a1, right_of_a2;
+
+	if (a2 - a1 >= 2.0 * M_PI)
+		return 1;
+	left_of_a1 = reference_left_of_ray(a1, px, py);
+	right_of_a2 = !reference_left_of_ray(a2, px, py);
+	if (a2 - a1 <= M_PI)
+		return left_of_a1 && right_of_a2;
+	return left_of_a1 || right_of_a2;
+}
+
+static void reference_filled_annulus_sector(struct reference_canvas *c, int x, int y,
+				float a1, float a2, int r1, int r2, int rings, int in_or_out)
+{
+	int i, j, k, px, py, d, outer, inner;
+
+	if (r2 <= 0 || r2 <= r1 || a2 <= a1)
+		return;
+	r1 = max(r1, 0);
+	if (rings < 1)
+		rings = 1;
+	if (rings > r2 - r1)
+		rings = r2 - r1;
+	for (j = y - r2; j <= y + r2; j++) {
+		for (i = x - r2; i <= x + r2; i++) {
+			px = i - x;
+			py = y - j;
+			d = px * px + py * py;
+			if (!reference_in_sector(a1, a2, px, py))
+				continue;
+			outer = r2;
+			for (k = 0; k < rings; k++) {
+				inner = r2 - (int) ((long long) (r2 - r1) * (k + 1) / rings);
+				if (d >= inner * inner && d < outer * outer)
+					reference_set_height(c, i, j, in_or_out * ((k & 1) ? 10 : 20));
+				outer = inner;
+			}
+		}
+	}
+}
+
+static void reference_primitive(struct reference_canvas *c, struct primitive *p)
+{
+	c->clipx1 = max(0, p->clipx1);
+	c->clipy1 = max(0, p->clipy1);
+	c->clipx2 = min(c->dim, p->clipx2);
+	c->clipy2 = min(c->dim, p->clipy2);
+	switch (p->type) {
+	case LINE:
+		reference_groove(c, p->x, p->y, p->p.line.len, p->p.line.dir, p->in_or_out);
+		break;
+	case RECTANGLE:
+		reference_rectangle(c, p->x, p->y, p->p.rectangle.w, p->p.rectangle.h, p->in_or_out);
+		break;
+	case CIRCLE:
+		reference_circle(c, p->x, p->y, p->p.circle.r, p->in_or_out);
+		break;
+	case ANNULUS_SECTOR:
+		reference_annulus_sector(c, p->x, p->y, p->p.annulus_sector.a1, p->p.annulus_sector.a2,
+			p->p.annulus_sector.inner_r, p->p.annulus_sector.outer_r, p->in_or_out);
+		break;
+	case FILLED_ANNULUS_SECTOR:
+		reference_filled_annulus_sector(c, p->x, p->y,
+			p->p.annulus_sector.a1, p->p.annulus_sector.a2,
+			p->p.annulus_sector.inner_r, p->p.annulus_sector.outer_r,
+			p->p.annulus_sector.rings, p->in_or_out);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Draws the scene one pixel at a time into a fresh heightmap */
+static void reference_heightmap(struct display_list *dl, unsigned char *heightmap, int accumulate)
+{
+	struct reference_canvas c;
+	size_t i, n = (size_t) dl->dim * dl->dim;
+	int j;
+
+	memset(&c, 0, sizeof(c));
+	c.heightmap = heightmap;
+	c.dim = dl->dim;
+	initialize_heightmap(heightmap, dl->dim, dl->dim);
+	if (accumulate) {
+		c.sum = calloc(n, sizeof(*c.sum));
+		if (!c.sum) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	for (j = 0; j < dl->nprimitives; j++)
+		reference_primitive(&c, &dl->p[j]);
+	if (accumulate) {
+		for (i = 0; i < n; i++)
+			heightmap[i] = max(0, min(255, heightmap[i] + c.sum[i]));
+		free(c.sum);
+	}
+}
+
+/* The reference normal map, calculate_normal() for every pixel */
+static void reference_normal_map(unsigned char *image, unsigned char *heightmap, int dim)
+{
+	union vec3 n;
+	int i, j;
+
+	for (j = 0; j < dim; j++)
+		for (i = 0; i < dim; i++) {
+			calculate_normal(heightmap, &n, i, j, dim);
+			normal_to_rgba(&n, &image[((size_t) j * dim + i) * 4]);
+		}
+}
+
+/* How a heightmap gets made */
+struct greeble_options {
+	int seed, dim, limit, filled;
+	int subtree_streams; /* parallel greebling's streams */
+	struct threadpool *pool; /* to greeble on, with subtree_streams */
+	int accumulate;
+	struct display_list *scene; /* record into this instead of drawing */
+};
+
+static void greeble(struct greeble_options *o, unsigned char *heightmap)
+{
+	struct greeble_context gc;
+	struct rng rng;
+
+	rng_init(&rng, o->seed);
+	initialize_heightmap(heightmap, o->dim, o->dim);
+	init_greeble_context(&gc, heightmap, o->dim);
+	gc.rng = &rng;
+	gc.filled_rings = o->filled;
+	gc.subtree_streams = o->subtree_streams;
+	gc.pool = o->subtree_streams ? o->pool : NULL;
+	gc.scene = o->scene;
+	if (o->scene)
+		display_list_init(o->scene, o->dim);
+	if (o->accumulate)
+		gc.accum = calloc((size_t) o->dim * o->dim, sizeof(*gc.accum));
+	greeble_area(&gc, 0, 0, o->dim - 1, o->dim - 1, o->limit);
+	if (gc.pool)
+		threadpool_wait(gc.pool);
+	if (gc.accum) {
+		materialize_accumulation(o->pool, &gc);
+		free(gc.accum);
+	}
+}
+
+static void replay(struct threadpool *pool, struct display_list *dl, int tiled,
+			int accumulate, unsigned char *heightmap)
+{
+	struct greeble_context gc;
+
+	initialize_heightmap(heightmap, dl->dim, dl->dim);
+	init_greeble_context(&gc, heightmap, dl->dim);
+	if (accumulate)
+		gc.accum = calloc((size_t) dl->dim * dl->dim, sizeof(*gc.accum));
+	if (tiled)
+		rasterize_display_list_tiled(pool, &gc, dl);
+	else
+		rasterize_display_list(&gc, dl);
+	if (gc.accum) {
+		materialize_accumulation(pool, &gc);
+		free(gc.accum);
+	}
+}
+
+static void check_heightmaps(struct greeble_options *o, struct threadpool *pool1,
+				struct threadpool *pool, unsigned char *expected)
+{
+	struct greeble_options opt = *o;
+	struct display_list scene, loaded;
+	unsigned char *got, *exact;
+	char scene_file[] = "/tmp/groovygreebler-check-XXXXXX";
+	int fd;
+
+	got = allocate_heightmap(o->dim);
+	exact = allocate_heightmap(o->dim);
+	if (!got || !exact) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	/* Greebling makes the same decisions whether it records or draws */
+	opt.scene = &scene;
+	opt.pool = pool1;
+	greeble(&opt, got);
+	reference_heightmap(&scene, expected, 0);
+	opt.scene = NULL;
+
+	greeble(&opt, got);
+	compare_images("drawing spans", expected, got, o->dim, 1, 0);
+	if (o->subtree_streams) {
+		opt.pool = pool;
+		greeble(&opt, got);
+		compare_images("parallel greebling", expected, got, o->dim, 1, 0);
+	}
+
+	replay(pool1, &scene, 0, 0, got);
+	compare_images("replay", expected, got, o->dim, 1, 0);
+	replay(pool, &scene, 1, 0, got);
+	compare_images("tiled replay", expected, got, o->dim, 1, 0);
+
+	fd = mkstemp(scene_file);
+	if (fd < 0 || display_list_save(&scene, scene_file) ||
+		display_list_load(&loaded, scene_file, o->dim)) {
+		nchecks++;
+		nfailures++;
+		printf("FAIL %s: scene file round trip: %s\n", case_name, strerror(errno));
+	} else {
+		replay(pool, &loaded, 1, 0, got);
+		compare_images("saved and loaded scene", expected, got, o->dim, 1, 0);
+		display_list_free(&loaded);
+	}
+	if (fd >= 0) {
+		close(fd);
+		unlink(scene_file);
+	}
+
+	/* Accumulation is exact against unclamped sums, close to saturating adds */
+	reference_heightmap(&scene, exact, 1);
+	opt.accumulate = 1;
+	opt.pool = o->subtree_streams ? pool : pool1;
+	greeble(&opt, got);
+	compare_images("accumulation, against clamping once", exact, got, o->dim, 1, 0);
+	compare_images("accumulation, against clamping always", expected, got, o->dim, 1,
+		(long) (ACCUMULATE_TOLERANCE * o->dim * o->dim));
+	replay(pool, &scene, 1, 1, got);
+	compare_images("accumulated replay", exact, got, o->dim, 1, 0);
+
+	display_list_free(&scene);
+	free(exact);
+	free(got);
+}
+
+static void check_normal_maps(struct threadpool *pool1, struct threadpool *pool,
+				unsigned char *heightmap, int dim)
+{
+	static const char *sobel_names[] = { "scalar", "sse4.1", "avx2" };
+	unsigned char *expected, *got;
+	short *dzdx, *dzdy, *ref_dzdx, *ref_dzdy;
+	sobel_row_fn fn;
+	int i, j, k, bad;
+
+	expected = allocate_output_image(dim, 4);
+	got = allocate_output_image(dim, 4);
+	dzdx = malloc(sizeof(*dzdx) * dim * 4);
+	if (!expected || !got || !dzdx) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	dzdy = dzdx + dim;
+	ref_dzdx = dzdy + dim;
+	ref_dzdy = ref_dzdx + dim;
+
+	reference_normal_map(expected, heightmap, dim);
+	paint_normal_map(pool1, got, heightmap, dim, 4);
+	compare_images("normal map", expected, got, dim, 4, 0);
+	paint_normal_map(pool, got, heightmap, dim, 4);
+	compare_images("threaded normal map", expected, got, dim, 4, 0);
+
+	/* RGB is the same without alpha */
+	paint_normal_map(pool, got, heightmap, dim, 3);
+	for (i = 0; i < dim * dim; i++)
+		memmove(&expected[i * 3], &expected[i * 4], 3);
+	compare_images("RGB normal map", expected, got, dim, 3, 0);
+	reference_normal_map(expected, heightmap, dim);
+
+	/* sobel_row() uses the best one, the others get checked here */
+	for (k = 0; k < ARRAY_SIZE(sobel_names); k++) {
+		fn = sobel_row_implementation(sobel_names[k]);
+		if (!fn)
+			continue;
+		nchecks++;
+		bad = 0;
+		for (j = 1; j < dim - 1 && !bad; j++) {
+			fn(&heightmap[(j - 1) * dim], &heightmap[j * dim], &heightmap[(j + 1) * dim],
+				dim, dzdx, dzdy);
+			sobel_row_scalar(&heightmap[(j - 1) * dim], &heightmap[j * dim],
+				&heightmap[(j + 1) * dim], dim, ref_dzdx, ref_dzdy);
+			for (i = 1; i < dim - 1; i++) {
+				if (dzdx[i] == ref_dzdx[i] && dzdy[i] == ref_dzdy[i])
+					continue;
+				printf("FAIL %s: sobel_row %s: first difference at (%d, %d), expected %d %d, got %d %d\n",
+					case_name, sobel_names[k], i, j, ref_dzdx[i], ref_dzdy[i], dzdx[i], dzdy[i]);
+				nfailures++;
+				bad = 1;
+				break;
+			}
+		}
+	}
+	/* And the lookup of normal bytes against calculate_normal() */
+	nchecks++;
+	for (j = 1, bad = 0; j < dim - 1 && !bad; j++) {
+		sobel_row_scalar(&heightmap[(j - 1) * dim], &heightmap[j * dim],
+				&heightmap[(j + 1) * dim], dim, dzdx, dzdy);
+		for (i = 1; i < dim - 1; i++) {
+			unsigned char *e = &expected[((size_t) j * dim + i) * 4];
+
+			if (e[0] == normal_byte[dzdx[i] + SOBEL_MAX_GRADIENT] &&
+				e[1] == normal_byte[dzdy[i] + SOBEL_MAX_GRADIENT] &&
+				e[2] == normal_blue && e[3] == 255)
+				continue;
+			printf("FAIL %s: normal bytes: first difference at (%d, %d)\n", case_name, i, j);
+			nfailures++;
+			bad = 1;
+			break;
+		}
+	}
+
+	free(dzdx);
+	free(got);
+	free(expected);
+}
+
+/*
+ * Writes image to png_file, flipped if invert is set, and reads it back
+ * unflipped.  With a pool, the parallel encoder writes it with profile.
+ */
+static void check_png_round_trip(const char *what, struct threadpool *pool,
+				const struct png_profile *profile, const char *png_file,
+				unsigned char *image, int dim, int invert)
+{
+	char whynot[256];
+	unsigned char *got = NULL;
+	int w, h, alpha, rc;
+
+	if (pool)
+		rc = png_parallel_write_image(pool, png_file, profile, image, dim, dim, 4, invert);
+	else
+		rc = png_utils_write_png_image(png_file, image, dim, dim, 1, invert);
+	if (rc == 0)
+		got = (unsigned char *) png_utils_read_png_image(png_file, invert, 0, 0, &w, &h, &alpha,
+					whynot, sizeof(whynot));
+	if (!got || w != dim || h != dim || !alpha) {
+		nchecks++;
+		nfailures++;
+		printf("FAIL %s: %s\n", case_name, what);
+	} else {
+		compare_images(what, image, got, dim, 4, 0);
+	}
+	free(got);
+}
+
+/*
+ * Writes pixels, with 1 or 3 channels, with the parallel encoder and
+ * checks that it reads back (as RGB) as rgb
+ */
+static void check_png_channels(const char *what, struct threadpool *pool, const char *png_file,
+				unsigned char *pixels, int channels, unsigned char *rgb, int dim)
+{
+	char whynot[256];
+	unsigned char *got = NULL;
+	int w, h, alpha, j, stride;
+
+	nchecks++;
+	if (png_parallel_write_image(pool, png_file, NULL, pixels, dim, dim, channels, 0) == 0)
+		got = (unsigned char *) png_utils_read_png_image(png_file, 0, 0, 0, &w, &h, &alpha,
+					whynot, sizeof(whynot));
+	if (!got || w != dim || h != dim || alpha) {
+		nfailures++;
+		printf("FAIL %s: %s\n", case_name, what);
+		free(got);
+		return;
+	}
+	/* The reader pads rows to 4 bytes */
+	stride = (dim * 3 + 3) & ~3;
+	for (j = 0; j < dim; j++) {
+		if (memcmp(&got[j * stride], &rgb[j * dim * 3], dim * 3) == 0)
+			continue;
+		nfailures++;
+		printf("FAIL %s: %s: first difference in row %d\n", case_name, what, j);
+		break;
+	}
+	free(got);
+}
+
+static void check_png(struct threadpool *pool1, struct threadpool *pool, unsigned char *image,
+			unsigned char *heightmap, int dim)
+{
+	/* The named ones, and every filter the named ones don't use */
+	const struct png_profile profiles[] = {
+		*png_parallel_profile("fastest"),
+		*png_parallel_profile("balanced"),
+		*png_parallel_profile("smallest"),
+		{ "adaptive", PNG_ADAPTIVE_FILTER, 6, Z_FILTERED },
+		{ "none", 0, 1, Z_RLE },
+		{ "sub", 1, 1, Z_DEFAULT_STRATEGY },
+		{ "average", 3, 1, Z_DEFAULT_STRATEGY },
+		{ "paeth", 4, 1, Z_DEFAULT_STRATEGY },
+	};
+	char png_file[] = "/tmp/groovygreebler-check-XXXXXX";
+	char what[64];
+	struct png_sink sink;
+	unsigned char *file_data, *rgb;
+	long file_size;
+	FILE *f;
+	int fd, i;
+
+	fd = mkstemp(png_file);
+	if (fd < 0) {
+		nchecks++;
+		nfailures++;
+		printf("FAIL %s: png: %s\n", case_name, strerror(errno));
+		return;
+	}
+	close(fd);
+	for (i = 0; i < ARRAY_SIZE(profiles); i++) {
+		snprintf(what, sizeof(what), "parallel png, %s", profiles[i].name);
+		check_png_round_trip(what, pool, &profiles[i], png_file, image, dim, 0);
+	}
+	check_png_round_trip("parallel png, 1 thread", pool1, NULL, png_file, image, dim, 0);
+	check_png_round_trip("parallel png, inverted", pool, NULL, png_file, image, dim, 1);
+	check_png_round_trip("png round trip, inverted", NULL, NULL, png_file, image, dim, 1);
+	check_png_round_trip("png round trip", NULL, NULL, png_file, image, dim, 0);
+
+	/* The memory sink has to get exactly what went into the file */
+	nchecks++;
+	file_data = NULL;
+	file_size = -1;
+	f = fopen(png_file, "r");
+	if (f) {
+		fseek(f, 0, SEEK_END);
+		file_size = ftell(f);
+		rewind(f);
+		file_data = malloc(file_size);
+		if (file_data && fread(file_data, 1, file_size, f) != (size_t) file_size)
+			file_size = -1;
+		fclose(f);
+	}
+	png_utils_memory_sink(&sink);
+	if (!file_data || file_size < 0 ||
+		png_utils_write_png_sink(&sink, image, dim, dim, 1, 0) ||
+		sink.size != (size_t) file_size || memcmp(sink.data, file_data, file_size)) {
+		nfailures++;
+		printf("FAIL %s: png memory sink differs from file\n", case_name);
+	}
+	free(sink.data);
+	free(file_data);
+
+	/* image is gray, so without alpha it's what the heightmap should read back as */
+	rgb = allocate_output_image(dim, 3);
+	if (!rgb) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < dim * dim; i++)
+		memcpy(&rgb[i * 3], &image[i * 4], 3);
+	check_png_channels("RGB png", pool, png_file, rgb, 3, rgb, dim);
+	check_png_channels("gray png", pool, png_file, heightmap, 1, rgb, dim);
+	free(rgb);
+	unlink(png_file);
+}
+
+/* A BC4 block as any decoder would read it */
+static void reference_bc4_decode(const unsigned char *block, unsigned char *values)
+{
+	int a = block[0], b = block[1], palette[8], i;
+	uint64_t bits = 0;
+
+	palette[0] = a;
+	palette[1] = b;
+	if (a > b) {
+		for (i = 1; i < 7; i++)
+			palette[i + 1] = ((7 - i) * a + i * b + 3) / 7;
+	} else {
+		for (i = 1; i < 5; i++)
+			palette[i + 1] = ((5 - i) * a + i * b + 2) / 5;
+		palette[6] = 0;
+		palette[7] = 255;
+	}
+	for (i = 0; i < 6; i++)
+		bits |= (uint64_t) block[2 + i] << (8 * i);
+	for (i = 0; i < 16; i++)
+		values[i] = palette[(bits >> (3 * i)) & 7];
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static unsigned char *read_file(const char *filename, long *size)
+{
+	unsigned char *data = NULL;
+	FILE *f;
+
+	*size = -1;
+	f = fopen(filename, "r");
+	if (!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	rewind(f);
+	data = malloc(*size);
+	if (data && fread(data, 1, *size, f) != (size_t) *size) {
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	return data;
+}
+
+/*
+ * Checks that the blocks of a w x h level decode to within the BC4 error
+ * bound, a 14th of each block's range plus rounding, of pixels, which are
+ * bpp bytes apart.  Returns the number of pixels that don't.
+ */
+static long check_texture_level(const unsigned char *blocks, const unsigned char *pixels,
+				int w, int h, int bpp, int channels)
+{
+	unsigned char expected[16], got[16];
+	int bx, by, c, i, x, y, min, max;
+	long bad = 0;
+
+	for (by = 0; by < (h + 3) / 4; by++) {
+		for (bx = 0; bx < (w + 3) / 4; bx++) {
+			for (c = 0; c < channels; c++) {
+				min = 255;
+				max = 0;
+				for (i = 0; i < 16; i++) {
+					x = bx * 4 + i % 4 < w ? bx * 4 + i % 4 : w - 1;
+					y = by * 4 + i / 4 < h ? by * 4 + i / 4 : h - 1;
+					expected[i] = pixels[((size_t) y * w + x) * bpp + c];
+					min = expected[i] < min ? expected[i] : min;
+					max = expected[i] > max ? expected[i] : max;
+				}
+				reference_bc4_decode(blocks, got);
+				blocks += BC4_BLOCK_BYTES;
+				for (i = 0; i < 16; i++)
+					if (abs(got[i] - expected[i]) > (max - min) / 14 + 1)
+						bad++;
+			}
+		}
+	}
+	return bad;
+}
+
+/*
+ * Writes pixels as a texture, with and without mipmaps, and reads the
+ * container back, checking every level against a plain box filtered mip
+ * chain.  One thread has to write exactly the same file.
+ */
+static void check_texture(const char *what, struct threadpool *pool1, struct threadpool *pool,
+			const char *file, int container, const unsigned char *pixels, int dim,
+			int bpp, int channels, int mipmaps)
+{
+	unsigned char *data, *data1 = NULL, *ref, *mip;
+	long size, size1, offset, length, bad;
+	int nlevels, w, h, nw, nh, x, y, c, l, k, x1, y1, format, expected_levels;
+
+	nchecks++;
+	for (expected_levels = 1; mipmaps && dim >> expected_levels; expected_levels++)
+		;
+	if (texture_write(pool1, file, container, pixels, dim, dim, bpp, channels, mipmaps) ||
+		!(data1 = read_file(file, &size1)) ||
+		texture_write(pool, file, container, pixels, dim, dim, bpp, channels, mipmaps) ||
+		!(data = read_file(file, &size))) {
+		nfailures++;
+		printf("FAIL %s: %s: %s\n", case_name, what, strerror(errno));
+		free(data1);
+		return;
+	}
+	if (size != size1 || memcmp(data, data1, size)) {
+		nfailures++;
+		printf("FAIL %s: %s: differs with 1 thread\n", case_name, what);
+	}
+	free(data1);
+
+	if (container == TEXTURE_DDS) {
+		format = size >= 148 && memcmp(data, "DDS ", 4) == 0 &&
+			memcmp(data + 84, "DX10", 4) == 0 ? get_le32(data + 128) : 0;
+		nlevels = size >= 148 ? get_le32(data + 28) : 0;
+		w = size >= 148 ? get_le32(data + 16) : 0;
+		h = size >= 148 ? get_le32(data + 12) : 0;
+		if (format != (channels == 1 ? 80 : 83) || nlevels != expected_levels ||
+			w != dim || h != dim) {
+			nfailures++;
+			printf("FAIL %s: %s: bad DDS header\n", case_name, what);
+			free(data);
+			return;
+		}
+	} else {
+		format = size >= 80 && memcmp(data + 1, "KTX 20", 6) == 0 ? get_le32(data + 12) : 0;
+		nlevels = size >= 80 ? get_le32(data + 40) : 0;
+		w = size >= 80 ? get_le32(data + 20) : 0;
+		h = size >= 80 ? get_le32(data + 24) : 0;
+		if (format != (channels == 1 ? 139 : 141) || nlevels != expected_levels ||
+			w != dim || h != dim || size < 80 + 24 * nlevels) {
+			nfailures++;
+			printf("FAIL %s: %s: bad KTX2 header\n", case_name, what);
+			free(data);
+			return;
+		}
+	}
+
+	/* Level 0 is the pixels, every level after packs just the channels */
+	ref = malloc((size_t) dim * dim * bpp);
+	if (!ref) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memcpy(ref, pixels, (size_t) dim * dim * bpp);
+	offset = 148;
+	for (l = 0; l < nlevels; l++) {
+		length = (long) ((w + 3) / 4) * ((h + 3) / 4) * BC4_BLOCK_BYTES * channels;
+		if (container == TEXTURE_KTX2) {
+			offset = get_le32(data + 80 + 24 * l);
+			if (get_le32(data + 80 + 24 * l + 8) != length)
+				offset = -1;
+		}
+		if (offset < 0 || offset + length > size) {
+			nfailures++;
+			printf("FAIL %s: %s: level %d isn't in the file\n", case_name, what, l);
+			break;
+		}
+		bad = check_texture_level(data + offset, ref, w, h, l ? channels : bpp, channels);
+		if (bad) {
+			nfailures++;
+			printf("FAIL %s: %s: %ld pixels of level %d are off\n", case_name, what, bad, l);
+			break;
+		}
+		offset += length;
+		if (l == nlevels - 1)
+			break;
+
+		nw = w > 1 ? w / 2 : 1;
+		nh = h > 1 ? h / 2 : 1;
+		k = l ? channels : bpp;
+		mip = malloc((size_t) nw * nh * channels);
+		if (!mip) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		for (y = 0; y < nh; y++) {
+			for (x = 0; x < nw; x++) {
+				x1 = 2 * x + 1 < w ? 2 * x + 1 : w - 1;
+				y1 = 2 * y + 1 < h ? 2 * y + 1 : h - 1;
+				for (c = 0; c < channels; c++)
+					mip[((size_t) y * nw + x) * channels + c] =
+						(ref[((size_t) 2 * y * w + 2 * x) * k + c] +
+						ref[((size_t) 2 * y * w + x1) * k + c] +
+						ref[((size_t) y1 * w + 2 * x) * k + c] +
+						ref[((size_t) y1 * w + x1) * k + c] + 2) / 4;
+			}
+		}
+		free(ref);
+		ref = mip;
+		w = nw;
+		h = nh;
+	}
+	free(ref);
+	free(data);
+}
+
+static void check_textures(struct threadpool *pool1, struct threadpool *pool,
+			unsigned char *heightmap, int dim)
+{
+	char file[] = "/tmp/groovygreebler-check-XXXXXX";
+	unsigned char *normals, simd[BC4_BLOCK_BYTES], scalar[BC4_BLOCK_BYTES], values[16];
+	bc4_encode_fn encode;
+	char what[64];
+	int fd, container, mipmaps, bx, by, i;
+	long ndiff = 0;
+
+	/* The SIMD block encoder has to agree with the scalar one exactly */
+	encode = bc4_encode_implementation("sse4.1");
+	if (encode) {
+		nchecks++;
+		for (by = 0; by < dim / 4; by++) {
+			for (bx = 0; bx < dim / 4; bx++) {
+				for (i = 0; i < 16; i++)
+					values[i] = heightmap[(size_t) (by * 4 + i / 4) * dim + bx * 4 + i % 4];
+				encode(values, simd);
+				bc4_encode_block_scalar(values, scalar);
+				ndiff += memcmp(simd, scalar, sizeof(simd)) != 0;
+			}
+		}
+		if (ndiff) {
+			nfailures++;
+			printf("FAIL %s: %ld sse4.1 BC4 blocks differ from scalar\n", case_name, ndiff);
+		}
+	}
+
+	fd = mkstemp(file);
+	normals = allocate_output_image(dim, 4);
+	if (fd < 0 || !normals) {
+		nchecks++;
+		nfailures++;
+		printf("FAIL %s: textures: %s\n", case_name, strerror(errno));
+		free(normals);
+		return;
+	}
+	close(fd);
+	paint_normal_map(pool, normals, heightmap, dim, 4);
+	for (container = TEXTURE_DDS; container <= TEXTURE_KTX2; container++) {
+		for (mipmaps = 0; mipmaps < 2; mipmaps++) {
+			snprintf(what, sizeof(what), "BC4 %s%s", texture_extension(container),
+				mipmaps ? ", mipmaps" : "");
+			check_texture(what, pool1, pool, file, container, heightmap, dim, 1, 1, mipmaps);
+			snprintf(what, sizeof(what), "BC5 %s%s", texture_extension(container),
+				mipmaps ? ", mipmaps" : "");
+			check_texture(what, pool1, pool, file, container, normals, dim, 4, 2, mipmaps);
+		}
+	}
+	free(normals);
+	unlink(file);
+}
+
+/*
+ * What the Mersenne Twister gave for these seeds before its refill was
+ * vectorized, which it has to keep giving: the first MTWIST_CHECK_DRAWS
+ * numbers drawn one at a time, as floats one at a time, and mixing single
+ * and bulk draws of both in chunks that straddle the 624 number refills.
+ * Hashes are FNV-1a of the 32-bit words (the bits, for floats), values are
+ * the numbers at mtwist_check_index[].
+ */
+#define MTWIST_CHECK_DRAWS 2000
+static const int mtwist_check_index[] = { 0, 1, 623, 624, 625, 1247, 1248, 1999 };
+static const int mtwist_chunks[] = { 1, 5, 17, 311, 624, 2, 700, 13 };
+
+enum mtwist_draws { MTWIST_NEXT, MTWIST_FLOAT, MTWIST_MIXED, MTWIST_NDRAWS };
+
+static const struct {
+	uint32_t seed;
+	uint32_t hash[MTWIST_NDRAWS];
+	uint32_t value[ARRAY_SIZE(mtwist_check_index)];
+} mtwist_known[] = {
+	{ 1, { 0x2f9d3a61, 0x177da059, 0xa4be2492 },
+		{ 0x6ac1f425, 0xff4780eb, 0x7792e739, 0x41d28138,
+		  0x37fb9a4e, 0x72d7f133, 0xc11a31c7, 0x083df88a } },
+	{ 2, { 0x3d957466, 0x0976963f, 0x1e197b39 },
+		{ 0x6f9d5ca8, 0x2f618a0f, 0xd9b5c4f7, 0xf794b9e9,
+		  0x3b05098b, 0xd37ba5ff, 0x714e4e28, 0xc8a82f1c } },
+	{ 5489, { 0xe0ac80ab, 0x3691bdc0, 0xd3b11b23 },
+		{ 0xd091bb5c, 0x22ae9ef6, 0xefa14dff, 0xf914dc58,
+		  0x246858c1, 0x974a05c7, 0x155f212f, 0xeb6335d3 } },
+	{ 0xdeadbeef, { 0x146dfdeb, 0x28ffb394, 0xd025576c },
+		{ 0x39037a7d, 0xe5052ed8, 0x50cdb043, 0xd6fa6c5c,
+		  0x747c0ac3, 0x3759e591, 0xdcd9dce0, 0xb95a75ab } },
+};
+
+static uint32_t fnv1a(const uint32_t *v, int n)
+{
+	uint32_t h = 2166136261u;
+	int i, b;
+
+	for (i = 0; i < n; i++)
+		for (b = 0; b < 32; b += 8)
+			h = (h ^ ((v[i] >> b) & 0xff)) * 16777619u;
+	return h;
+}
+
+/* Draws n numbers into out, floats as their bits */
+static void mtwist_draw(struct mtwist_state *mt, int how, uint32_t *out, int n)
+{
+	int i = 0, c, k, len;
+	float f;
+
+	for (c = 0; i < n; c++) {
+		len = how == MTWIST_MIXED ? mtwist_chunks[c % ARRAY_SIZE(mtwist_chunks)] : 1;
+		if (len > n - i)
+			len = n - i;
+		/* Mixed draws take turns with next, fill_u32, float and fill_float */
+		switch (how == MTWIST_MIXED ? c % 4 : how) {
+		case 0:
+			for (k = 0; k < len; k++)
+				out[i + k] = mtwist_next(mt);
+			break;
+		case 1:
+			for (k = 0; k < len; k++) {
+				f = mtwist_float(mt);
+				memcpy(&out[i + k], &f, sizeof(f));
+			}
+			break;
+		case 2:
+			mtwist_fill_u32(mt, &out[i], len);
+			break;
+		case 3:
+			mtwist_fill_float(mt, (float *) &out[i], len);
+			break;
+		}
+		i += len;
+	}
+}
+
+static void check_mtwist(void)
+{
+	static const char *draws_name[] = { "mtwist_next", "mtwist_float", "mixed" };
+	struct mtwist_state *mt;
+	uint32_t v[MTWIST_CHECK_DRAWS];
+	int s, how, i;
+
+	for (s = 0; s < ARRAY_SIZE(mtwist_known); s++) {
+		snprintf(case_name, sizeof(case_name), "mtwist seed %u", mtwist_known[s].seed);
+		for (how = 0; how < MTWIST_NDRAWS; how++) {
+			mt = mtwist_init(mtwist_known[s].seed);
+			if (!mt) {
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+			mtwist_draw(mt, how, v, MTWIST_CHECK_DRAWS);
+			mtwist_free(mt);
+			nchecks++;
+			if (fnv1a(v, MTWIST_CHECK_DRAWS) != mtwist_known[s].hash[how]) {
+				nfailures++;
+				printf("FAIL %s: %s draws differ from the known stream\n",
+					case_name, draws_name[how]);
+			}
+			if (how != MTWIST_NEXT)
+				continue;
+			for (i = 0; i < ARRAY_SIZE(mtwist_check_index); i++) {
+				nchecks++;
+				if (v[mtwist_check_index[i]] == mtwist_known[s].value[i])
+					continue;
+				nfailures++;
+				printf("FAIL %s: draw %d is 0x%08x, expected 0x%08x\n", case_name,
+					mtwist_check_index[i], v[mtwist_check_index[i]],
+					mtwist_known[s].value[i]);
+			}
+		}
+		printf("%s: done\n", case_name);
+	}
+}
+
+/*
+ * Scene files of one primitive: type, then x and y and its parameters as
+ * floats (rings last, for FILLED_ANNULUS_SECTOR), and whether loading it
+ * should work.  The bad ones must fail to load rather than be drawn.
+ */
+static const struct {
+	const char *what;
+	int type, nparams;
+	float param[6];
+	uint32_t rings;
+	int good;
+} scene_cases[] = {
+	{ "circle", CIRCLE, 3, { 0.5f, 0.5f, 0.1f }, 0, 1 },
+	{ "inside out rectangle", RECTANGLE, 4, { 0.5f, 0.5f, -0.1f, -0.2f }, 0, 1 },
+	{ "filled annulus sector", FILLED_ANNULUS_SECTOR, 6, { 0.5f, 0.5f, 0.1f, 0.2f, 0.0f, 1.0f }, 3, 1 },
+	{ "NaN radius", CIRCLE, 3, { 0.5f, 0.5f, NAN }, 0, 0 },
+	{ "infinite radius", CIRCLE, 3, { 0.5f, 0.5f, INFINITY }, 0, 0 },
+	{ "huge radius", CIRCLE, 3, { 0.5f, 0.5f, 1e30f }, 0, 0 },
+	{ "negative radius", CIRCLE, 3, { 0.5f, 0.5f, -0.1f }, 0, 0 },
+	{ "huge position", RECTANGLE, 4, { 1e9f, 0.5f, 0.1f, 0.1f }, 0, 0 },
+	{ "negative groove", LINE, 3, { 0.5f, 0.5f, -0.5f }, 0, 0 },
+	{ "inner radius past outer", ANNULUS_SECTOR, 6, { 0.5f, 0.5f, 0.3f, 0.2f, 0.0f, 1.0f }, 0, 0 },
+	{ "NaN angle", ANNULUS_SECTOR, 6, { 0.5f, 0.5f, 0.1f, 0.2f, NAN, 1.0f }, 0, 0 },
+	{ "too many rings", FILLED_ANNULUS_SECTOR, 6, { 0.5f, 0.5f, 0.1f, 0.2f, 0.0f, 1.0f }, 0xffffffff, 0 },
+};
+
+static void put_scene_u32(FILE *f, uint32_t v)
+{
+	fputc(v & 0xff, f);
+	fputc((v >> 8) & 0xff, f);
+	fputc((v >> 16) & 0xff, f);
+	fputc(v >> 24, f);
+}
+
+static void check_scene_files(void)
+{
+	char scene_file[] = "/tmp/groovygreebler-check-XXXXXX";
+	struct display_list dl;
+	uint32_t u;
+	FILE *f;
+	int fd, i, k, rc;
+
+	snprintf(case_name, sizeof(case_name), "scene files");
+	fd = mkstemp(scene_file);
+	if (fd < 0) {
+		nchecks++;
+		nfailures++;
+		printf("FAIL %s: %s\n", case_name, strerror(errno));
+		return;
+	}
+	close(fd);
+	for (i = 0; i < ARRAY_SIZE(scene_cases); i++) {
+		nchecks++;
+		f = fopen(scene_file, "w");
+		if (!f) {
+			nfailures++;
+			printf("FAIL %s: %s: %s\n", case_name, scene_cases[i].what, strerror(errno));
+			continue;
+		}
+		fwrite("GGDL", 1, 4, f);
+		put_scene_u32(f, 1);
+		put_scene_u32(f, 1024);
+		put_scene_u32(f, 1);
+		fputc(scene_cases[i].type, f);
+		fputc(0, f);
+		for (k = 0; k < scene_cases[i].nparams; k++) {
+			memcpy(&u, &scene_cases[i].param[k], sizeof(u));
+			put_scene_u32(f, u);
+		}
+		if (scene_cases[i].type == FILLED_ANNULUS_SECTOR)
+			put_scene_u32(f, scene_cases[i].rings);
+		fclose(f);
+		rc = display_list_load(&dl, scene_file, 1024);
+		if (rc == 0)
+			display_list_free(&dl);
+		if ((rc == 0) == scene_cases[i].good)
+			continue;
+		nfailures++;
+		printf("FAIL %s: %s %s\n", case_name, scene_cases[i].what,
+			scene_cases[i].good ? "didn't load" : "loaded");
+	}
+	unlink(scene_file);
+	printf("%s: done\n", case_name);
+}
+
+static void check_case(struct greeble_options *o, struct threadpool *pool1, struct threadpool *pool,
+			unsigned char *heightmap)
+{
+	snprintf(case_name, sizeof(case_name), "seed %d size %d limit %d%s%s",
+		o->seed, o->dim, o->limit, o->filled ? " filled rings" : "",
+		o->subtree_streams ? " parallel" : "");
+	check_heightmaps(o, pool1, pool, heightmap);
+	check_normal_maps(pool1, pool, heightmap, o->dim);
+	printf("%s: done\n", case_name);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	struct threadpool *pool1, *pool;
+	struct greeble_options o;
+	unsigned char *heightmap, *image;
+	int s, d, l, f, p;
+
+	pool1 = threadpool_create(1);
+	pool = threadpool_create(CHECK_THREADS);
+	if (!pool1 || !pool) {
+		fprintf(stderr, "Failed to create thread pools\n");
+		return 1;
+	}
+	check_mtwist();
+	check_scene_files();
+	for (d = 0; d < ARRAY_SIZE(check_sizes); d++) {
+		heightmap = allocate_heightmap(check_sizes[d]);
+		image = allocate_output_image(check_sizes[d], 4);
+		if (!heightmap || !image) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		for (s = 0; s < ARRAY_SIZE(check_seeds); s++) {
+			for (l = 0; l < ARRAY_SIZE(check_limits); l++) {
+				for (f = 0; f < 2; f++) {
+					for (p = 0; p < 2; p++) {
+						memset(&o, 0, sizeof(o));
+						o.seed = check_seeds[s];
+						o.dim = check_sizes[d];
+						o.limit = check_limits[l];
+						o.filled = f;
+						o.subtree_streams = p;
+						check_case(&o, pool1, pool, heightmap);
+					}
+				}
+			}
+		}
+		paint_height_map(image, heightmap, check_sizes[d], 0, 255);
+		check_png(pool1, pool, image, heightmap, check_sizes[d]);
+		check_textures(pool1, pool, heightmap, check_sizes[d]);
+		free(image);
+		free(heightmap);
+	}
+	threadpool_destroy(pool);
+	threadpool_destroy(pool1);
+	printf("%d checks, %d failed\n", nchecks, nfailures);
+	return nfailures ? 1 : 0;
+}
@@ -0,0 +1,328 @@
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+
+#include "display_list.h"
+
+/*
+ * Scene file layout, all numbers little endian:
+ *
+ *   "GGDL"            magic
+ *   u32 version       currently 1
+ *   u32 dim           size of the map the scene was generated for (informational)
+ *   u32 count         number of primitives
+ *
+ * followed by count primitives, each of which is
+ *
+ *   u8 type           LINE, RECTANGLE, CIRCLE, ANNULUS_SECTOR or FILLED_ANNULUS_SECTOR
+ *   u8 flags          SCENE_NEGATIVE, SCENE_VERTICAL, SCENE_CLIPPED
+ *   f32 ...           parameters, see below
+ *   f32 x4            clip rectangle x1, y1, x2, y2, only if SCENE_CLIPPED
+ *
+ * LINE: x, y, len.  RECTANGLE: x, y, w, h.  CIRCLE: x, y, r.
+ * ANNULUS_SECTOR: x, y, inner_r, outer_r, a1, a2.
+ * FILLED_ANNULUS_SECTOR: x, y, inner_r, outer_r, a1, a2, then rings as a u32.
+ *
+ * Positions and lengths are divided by the size of the map, angles are in
+ * radians.  Unclipped means clipped only by the edges of the map.
+ *
+ * Scene files come from users, so loading rejects anything greebling
+ * couldn't have produced and drawing couldn't cope with: values that
+ * aren't finite, positions and sizes more than SCENE_MAX_NORMALIZED map
+ * sizes out, negative lengths and radii, radii over SCENE_MAX_RADIUS (so
+ * that r * r stays within an int at any map size), an inner radius past
+ * the outer one, and more than SCENE_MAX_RINGS rings.  Rectangles can
+ * have negative sizes, greebling makes those.
+ */
+#define SCENE_MAGIC "GGDL"
+#define SCENE_VERSION 1
+
+#define SCENE_NEGATIVE (1 << 0) /* in_or_out is -1 */
+#define SCENE_VERTICAL (1 << 1) /* LINE with dir 1 */
+#define SCENE_CLIPPED (1 << 2)
+
+#define SCENE_MAX_NORMALIZED 4.0f
+#define SCENE_MAX_RADIUS 1.0f
+#define SCENE_MAX_ANGLE (4.0f * (float) M_PI)
+#define SCENE_MAX_RINGS 1024
+
+void display_list_init(struct display_list *dl, int dim)
+{
+	memset(dl, 0, sizeof(*dl));
+	dl->dim = dim;
+}
+
+int display_list_append(struct display_list *dl, struct primitive *p)
+{
+	struct primitive *newp;
+	int newsize;
+
+	if (dl->nprimitives == dl->size) {
+		newsize = dl->size ? dl->size * 2 : 1024;
+		newp = realloc(dl->p, sizeof(*newp) * newsize);
+		if (!newp)
+			return -1;
+		dl->p = newp;
+		dl->size = newsize;
+	}
+	dl->p[dl->nprimitives++] = *p;
+	return 0;
+}
+
+void display_list_free(struct display_list *dl)
+{
+	free(dl->p);
+	dl->p = NULL;
+	dl->nprimitives = 0;
+	dl->size = 0;
+}
+
+static void put_u32(FILE *f, uint32_t v)
+{
+	unsigned char b[4];
+
+	b[0] = v & 0xff;
+	b[1] = (v >> 8) & 0xff;
+	b[2] = (v >> 16) & 0xff;
+	b[3] = (v >> 24) & 0xff;
+	fwrite(b, 1, 4, f);
+}
+
+static void put_f32(FILE *f, float v)
+{
+	uint32_t u;
+
+	memcpy(&u, &v, sizeof(u));
+	put_u32(f, u);
+}
+
+static void put_normalized(FILE *f, int v, int dim)
+{
+	put_f32(f, (float) ((double) v / dim));
+}
+
+static int get_u32(FILE *f, uint32_t *v)
+{
+	unsigned char b[4];
+
+	if (fread(b, 1, 4, f) != 4)
+		return -1;
+	*v = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+	return 0;
+}
+
+static int get_f32(FILE *f, float *v)
+{
+	uint32_t u;
+
+	if (get_u32(f, &u))
+		return -1;
+	memcpy(v, &u, sizeof(*v));
+	return 0;
+}
+
+/* Fails unless the value is finite and in lo .. hi */
+static int get_normalized(FILE *f, int *v, int dim, float lo, float hi)
+{
+	float u;
+
+	if (get_f32(f, &u) || !isfinite(u) || u < lo || u > hi)
+		return -1;
+	*v = (int) lrint((double) u * dim);
+	return 0;
+}
+
+static int get_position(FILE *f, int *v, int dim)
+{
+	return get_normalized(f, v, dim, -SCENE_MAX_NORMALIZED, SCENE_MAX_NORMALIZED);
+}
+
+static int get_angle(FILE *f, float *a)
+{
+	if (get_f32(f, a) || !isfinite(*a) || fabsf(*a) > SCENE_MAX_ANGLE)
+		return -1;
+	return 0;
+}
+
+static int is_clipped(struct display_list *dl, struct primitive *p)
+{
+	return p->clipx1 > 0 || p->clipy1 > 0 || p->clipx2 < dl->dim || p->clipy2 < dl->dim;
+}
+
+int display_list_save(struct display_list *dl, const char *filename)
+{
+	struct primitive *p;
+	int i, dim = dl->dim, flags, rc;
+	FILE *f;
+
+	f = fopen(filename, "w");
+	if (!f)
+		return -1;
+	fwrite(SCENE_MAGIC, 1, 4, f);
+	put_u32(f, SCENE_VERSION);
+	put_u32(f, dim);
+	put_u32(f, dl->nprimitives);
+	for (i = 0; i < dl->nprimitives; i++) {
+		p = &dl->p[i];
+		flags = 0;
+		if (p->in_or_out < 0)
+			flags |= SCENE_NEGATIVE;
+		if (p->type == LINE && p->p.line.dir)
+			flags |= SCENE_VERTICAL;
+		if (is_clipped(dl, p))
+			flags |= SCENE_CLIPPED;
+		fputc(p->type, f);
+		fputc(flags, f);
+		put_normalized(f, p->x, dim);
+		put_normalized(f, p->y, dim);
+		switch (p->type) {
+		case LINE:
+			put_normalized(f, p->p.line.len, dim);
+			break;
+		case RECTANGLE:
+			put_normalized(f, p->p.rectangle.w, dim);
+			put_normalized(f, p->p.rectangle.h, dim);
+			break;
+		case CIRCLE:
+			put_normalized(f, p->p.circle.r, dim);
+			break;
+		case ANNULUS_SECTOR:
+		case FILLED_ANNULUS_SECTOR:
+			put_normalized(f, p->p.annulus_sector.inner_r, dim);
+			put_normalized(f, p->p.annulus_sector.outer_r, dim);
+			put_f32(f, p->p.annulus_sector.a1);
+			put_f32(f, p->p.annulus_sector.a2);
+			if (p->type == FILLED_ANNULUS_SECTOR)
+				put_u32(f, p->p.annulus_sector.rings);
+			break;
+		default:
+			break;
+		}
+		if (flags & SCENE_CLIPPED) {
+			put_normalized(f, p->clipx1, dim);
+			put_normalized(f, p->clipy1, dim);
+			put_normalized(f, p->clipx2, dim);
+			put_normalized(f, p->clipy2, dim);
+		}
+	}
+	rc = ferror(f) ? -1 : 0;
+	if (fclose(f))
+		rc = -1;
+	return rc;
+}
+
+static int load_primitive(FILE *f, struct primitive *p, int dim)
+{
+	int type, flags, rc;
+	uint32_t rings;
+
+	type = fgetc(f);
+	flags = fgetc(f);
+	if (type == EOF || flags == EOF)
+		return -1;
+	memset(p, 0, sizeof(*p));
+	p->type = type;
+	p->in_or_out = (flags & SCENE_NEGATIVE) ? -1 : 1;
+	rc = get_position(f, &p->x, dim);
+	rc |= get_position(f, &p->y, dim);
+	switch (type) {
+	case LINE:
+		rc |= get_normalized(f, &p->p.line.len, dim, 0.0f, SCENE_MAX_NORMALIZED);
+		p->p.line.dir = (flags & SCENE_VERTICAL) ? 1 : 0;
+		break;
+	case RECTANGLE:
+		rc |= get_position(f, &p->p.rectangle.w, dim);
+		rc |= get_position(f, &p->p.rectangle.h, dim);
+		break;
+	case CIRCLE:
+		rc |= get_normalized(f, &p->p.circle.r, dim, 0.0f, SCENE_MAX_RADIUS);
+		break;
+	case ANNULUS_SECTOR:
+	case FILLED_ANNULUS_SECTOR:
+		rc |= get_normalized(f, &p->p.annulus_sector.inner_r, dim, 0.0f, SCENE_MAX_RADIUS);
+		rc |= get_normalized(f, &p->p.annulus_sector.outer_r, dim, 0.0f, SCENE_MAX_RADIUS);
+		rc |= get_angle(f, &p->p.annulus_sector.a1);
+		rc |= get_angle(f, &p->p.annulus_sector.a2);
+		if (!rc && p->p.annulus_sector.inner_r > p->p.annulus_sector.outer_r)
+			rc = -1;
+		if (type == FILLED_ANNULUS_SECTOR) {
+			rc |= get_u32(f, &rings);
+			if (rings > SCENE_MAX_RINGS)
+				rc = -1;
+			p->p.annulus_sector.rings = rings;
+		}
+		break;
+	default:
+		return -1;
+	}
+	if (flags & SCENE_CLIPPED) {
+		rc |= get_position(f, &p->clipx1, dim);
+		rc |= get_position(f, &p->clipy1, dim);
+		rc |= get_position(f, &p->clipx2, dim);
+		rc |= get_position(f, &p->clipy2, dim);
+	} else {
+		p->clipx1 = 0;
+		p->clipy1 = 0;
+		p->clipx2 = dim;
+		p->clipy2 = dim;
+	}
+	return rc;
+}
+
+int display_list_load(struct display_list *dl, const char *filename, int dim)
+{
+	char magic[4];
+	uint32_t version, scene_dim, count, i;
+	struct primitive p;
+	FILE *f;
+
+	display_list_init(dl, dim);
+	f = fopen(filename, "r");
+	if (!f)
+		return -1;
+	if (fread(magic, 1, 4, f) != 4 || memcmp(magic, SCENE_MAGIC, 4) ||
+		get_u32(f, &version) || version != SCENE_VERSION ||
+		get_u32(f, &scene_dim) || get_u32(f, &count))
+		goto bad_file;
+	for (i = 0; i < count; i++) {
+		if (load_primitive(f, &p, dim))
+			goto bad_file;
+		if (display_list_append(dl, &p)) {
+			display_list_free(dl);
+			fclose(f);
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	fclose(f);
+	return 0;
+
+bad_file:
+	display_list_free(dl);
+	fclose(f);
+	errno = EINVAL;
+	return -1;
+}
@@ -0,0 +1,82 @@
+#ifndef DISPLAY_LIST_H__
+#define DISPLAY_LIST_H__
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#define LINE 0
+#define RECTANGLE 1
+#define CIRCLE 2
+#define ANNULUS_SECTOR 3
+#define FILLED_ANNULUS_SECTOR 4
+#define NPRIMITIVE_TYPES 5
+
+struct primitive {
+	union params {
+		struct {
+			int r;
+		} circle;
+		struct {
+			int w, h;
+		} rectangle;
+		struct {
+			int len, dir;
+		} line;
+		struct {
+			int inner_r, outer_r;
+			float a1, a2;
+			int rings; /* FILLED_ANNULUS_SECTOR only */
+		} annulus_sector;
+	} p;
+	int type;
+	int in_or_out;
+	int x, y;
+	/* Primitives in a display list only touch [clipx1, clipx2) x [clipy1, clipy2) */
+	int clipx1, clipy1, clipx2, clipy2;
+};
+
+/*
+ * A display list is the sequence of primitives greebling decided on, in the
+ * order they have to be drawn, in pixel coordinates of a dim x dim map.  In
+ * a display list every primitive is drawn as is: a RECTANGLE is a plain
+ * panel (never greebled inside), a CIRCLE is just the disc.
+ */
+struct display_list {
+	int dim;
+	int nprimitives;
+	int size;
+	struct primitive *p;
+};
+
+void display_list_init(struct display_list *dl, int dim);
+int display_list_append(struct display_list *dl, struct primitive *p);
+void display_list_free(struct display_list *dl);
+
+/*
+ * Scene files hold a display list in coordinates normalized to the size of
+ * the map, so that it can be loaded back at any size.  Loading at the size
+ * it was saved from gives back exactly the same primitives.
+ *
+ * Both return 0 on success, -1 on failure, with errno set.
+ */
+int display_list_save(struct display_list *dl, const char *filename);
+int display_list_load(struct display_list *dl, const char *filename, int dim);
+
+#endif
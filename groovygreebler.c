@@ -24,18 +24,40 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <math.h>
+#include <getopt.h>
 
 #include "quat.h"
 #include "png_utils.h"
+#include "png_parallel.h"
 #include "bline.h"
+#include "threadpool.h"
+#include "sobel.h"
+#include "rng.h"
+#include "timing.h"
+#include "trace.h"
+#include "perf_counters.h"
+#include "display_list.h"
+#include "span.h"
+#include "texture.h"
 
 #define DIM 4096
 #define LIMIT 32
 
-#define LINE 0
-#define RECTANGLE 1
-#define CIRCLE 2
-#define ANNULUS_SECTOR 3
+/* Rows of the normal map computed per job.  A band reads band + 2 rows of the
+ * heightmap and writes band rows of the RGBA normal map, 16 rows at DIM = 4096
+ * is about 330k, which stays in a typical L2.
+ */
+#define NORMALMAP_BAND_ROWS 16
+
+/* In parallel greebling, subtrees covering at least this many pixels are run as tasks */
+#define GREEBLE_TASK_AREA (128 * 128)
+
+/* Rows, then columns, of the accumulation buffer per job when summing it up */
+#define ACCUMULATE_BAND_ROWS 16
+#define ACCUMULATE_STRIP_COLUMNS 256
+
+/* Display lists are rasterized in parallel in square tiles of this many pixels on a side */
+#define RASTER_TILE_SIZE 256
 
 const int xo[] = { 1, 0 };
 const int yo[] = { 0, 1 };
@@ -50,32 +72,10 @@ int min(int a, int b)
 	return (a < b ? a : b);
 }
 
-struct primitive {
-	union params {
-		struct {
-			int r;
-		} circle;
-		struct {
-			int w, h;
-		} rectangle;
-		struct {
-			int len, dir;
-		} line;
-		struct {
-			int inner_r, outer_r;
-			float a1, a2;
-		} annulus_sector;
-	} p;
-	int type;
-	int in_or_out;
-	int x, y;
-};
-
-static void calculate_normal(unsigned char *heightmap, union vec3 *normalmap, int i, int j, int dim)
+static void calculate_normal(unsigned char *heightmap, union vec3 *n, int i, int j, int dim)
 {
 	int i1, i2, j1, j2;
 	int p1, p2, dzdx[3], dzdy[3];
-	union vec3 n;
 
 	i1 = i - 1;
 	if (i1 < 0)
@@ -116,64 +116,149 @@ static void calculate_normal(unsigned char *heightmap, union vec3 *normalmap, in
 	dzdx[0] = dzdx[0] + 2 * dzdx[1] + dzdx[1];
 	dzdy[0] = -dzdy[0] - 2 * dzdy[1] - dzdy[1];
 
-	n.v.x = ((float) dzdx[0] / 4.0) / 127.0f + 0.5;
-	n.v.y = ((float) dzdy[0] / 4.0) / 127.0f + 0.5;
-	n.v.z = 1.0f;
-	normalmap[j * dim + i] = n;
+	n->v.x = ((float) dzdx[0] / 4.0) / 127.0f + 0.5;
+	n->v.y = ((float) dzdy[0] / 4.0) / 127.0f + 0.5;
+	n->v.z = 1.0f;
 }
 
-static void calculate_normalmap(unsigned char *heightmap, union vec3 *normalmap, int dim)
+/* Going through int keeps out of range values well defined (they wrap the
+ * way a run time float to char conversion does on x86, where this always ran)
+ * instead of leaving them to whatever the compiler folds them to.
+ */
+static void normal_to_rgba(union vec3 *n, unsigned char *rgba)
 {
-	int i, j;
+	char red, green, blue;
 
-	for (i = 0; i < dim; i++)
-		for (j = 0; j < dim; j++)
-			calculate_normal(heightmap, normalmap, i, j, dim);
+	red = (int) (n->v.x * 255);
+	green = (int) (n->v.y * 255);
+	blue = (int) (n->v.z * 255);
+	rgba[0] = red;
+	rgba[1] = green;
+	rgba[2] = blue;
+	rgba[3] = 255;
 }
 
-static void initialize_heightmap(unsigned char *h, int xdim, int ydim)
+/* normal_byte[g + SOBEL_MAX_GRADIENT] is the red (or green) byte that
+ * calculate_normal() and normal_to_rgba() produce for an x (or y) gradient
+ * of g, so that the vectorized path produces identical output.  The blue
+ * byte doesn't depend on the gradient at all.
+ */
+static unsigned char normal_byte[2 * SOBEL_MAX_GRADIENT + 1];
+static unsigned char normal_blue;
+
+static void init_normal_bytes(void)
 {
-	memset(h, 128, xdim * ydim);
+	int g;
+	union vec3 n;
+	unsigned char rgba[4];
+
+	for (g = -SOBEL_MAX_GRADIENT; g <= SOBEL_MAX_GRADIENT; g++) {
+		n.v.x = ((float) g / 4.0) / 127.0f + 0.5;
+		n.v.y = n.v.x;
+		n.v.z = 1.0f;
+		normal_to_rgba(&n, rgba);
+		normal_byte[g + SOBEL_MAX_GRADIENT] = rgba[0];
+		normal_blue = rgba[2];
+	}
 }
 
-unsigned char heightmap[DIM][DIM];
-union vec3 normalmap[DIM][DIM];
+struct normalmap_job {
+	unsigned char *heightmap;
+	unsigned char *image;
+	int dim;
+	int channels; /* 3 for RGB, 4 for RGBA */
+};
 
-static unsigned char *allocate_heightmap(int dim)
+static void paint_normal_map_edge(struct normalmap_job *job, int i, int j)
 {
-	return malloc(dim * dim);
+	unsigned char rgba[4];
+	union vec3 n;
+
+	calculate_normal(job->heightmap, &n, i, j, job->dim);
+	normal_to_rgba(&n, rgba);
+	memcpy(&job->image[((size_t) j * job->dim + i) * job->channels], rgba, job->channels);
 }
 
-static union vec3 *allocate_normalmap(int dim)
+/* Goes straight from the heightmap to RGBA bytes.  Interior pixels go through
+ * the vectorized sobel_row(), the one pixel border needs clamped neighbors and
+ * goes through calculate_normal().
+ */
+static void paint_normal_map_band(void *context, int band)
 {
-	return malloc(sizeof(union vec3) * dim * dim);
+	struct normalmap_job *job = context;
+	unsigned char *h = job->heightmap;
+	unsigned char *out;
+	int i, j, j1, j2, dim = job->dim, c = job->channels;
+	short *dzdx, *dzdy;
+
+	trace_begin("normal map", "band", "band", band);
+	j1 = band * NORMALMAP_BAND_ROWS;
+	j2 = min(j1 + NORMALMAP_BAND_ROWS, dim);
+	dzdx = malloc(sizeof(*dzdx) * dim * 2);
+	if (!dzdx) {
+		fprintf(stderr, "Out of memory computing normal map\n");
+		exit(1);
+	}
+	dzdy = dzdx + dim;
+	for (j = j1; j < j2; j++) {
+		if (j == 0 || j == dim - 1 || dim < 3) {
+			for (i = 0; i < dim; i++)
+				paint_normal_map_edge(job, i, j);
+			continue;
+		}
+		sobel_row(&h[(j - 1) * dim], &h[j * dim], &h[(j + 1) * dim], dim, dzdx, dzdy);
+		out = &job->image[(size_t) j * dim * c];
+		if (c == 4) {
+			for (i = 1; i < dim - 1; i++) {
+				out[4 * i + 0] = normal_byte[dzdx[i] + SOBEL_MAX_GRADIENT];
+				out[4 * i + 1] = normal_byte[dzdy[i] + SOBEL_MAX_GRADIENT];
+				out[4 * i + 2] = normal_blue;
+				out[4 * i + 3] = 255;
+			}
+		} else {
+			for (i = 1; i < dim - 1; i++) {
+				out[3 * i + 0] = normal_byte[dzdx[i] + SOBEL_MAX_GRADIENT];
+				out[3 * i + 1] = normal_byte[dzdy[i] + SOBEL_MAX_GRADIENT];
+				out[3 * i + 2] = normal_blue;
+			}
+		}
+		paint_normal_map_edge(job, 0, j);
+		paint_normal_map_edge(job, dim - 1, j);
+	}
+	free(dzdx);
+	trace_end("normal map", "band");
 }
 
-static unsigned char *allocate_output_image(int dim)
+/* Into RGBA pixels if channels is 4, RGB if it's 3 */
+static void paint_normal_map(struct threadpool *pool, unsigned char *normal_image,
+				unsigned char *heightmap, int dim, int channels)
 {
-	unsigned char *x = malloc(4 * dim * dim);
-	memset(x, 0, 4 * dim * dim);
-	return x;
+	struct normalmap_job job;
+	int nbands;
+
+	init_normal_bytes();
+	job.heightmap = heightmap;
+	job.image = normal_image;
+	job.dim = dim;
+	job.channels = channels;
+	nbands = (dim + NORMALMAP_BAND_ROWS - 1) / NORMALMAP_BAND_ROWS;
+	threadpool_parallel_for(pool, nbands, paint_normal_map_band, &job);
 }
 
-static void paint_normal_map(unsigned char *normal_image, union vec3 *normal_map, int dim)
+static void initialize_heightmap(unsigned char *h, int xdim, int ydim)
 {
-	int i, j;
-	char red, green, blue;
-	int p;
+	memset(h, 128, (size_t) xdim * ydim);
+}
 
-	for (i = 0; i < dim; i++) {
-		for (j = 0; j < dim; j++) {
-			p = (j * dim + i);
-			red = normal_map[p].v.x * 255;
-			green = normal_map[p].v.y * 255;
-			blue = normal_map[p].v.z * 255;
-			normal_image[4 * p + 0] = red;
-			normal_image[4 * p + 1] = green;
-			normal_image[4 * p + 2] = blue;
-			normal_image[4 * p + 3] = 255;
-		}
-	}
+static unsigned char *allocate_heightmap(int dim)
+{
+	return malloc((size_t) dim * dim);
+}
+
+/* Not cleared, every byte gets painted */
+static unsigned char *allocate_output_image(int dim, int channels)
+{
+	return malloc((size_t) channels * dim * dim);
 }
 
 static void paint_height_map(unsigned char *image, unsigned char *hmap, int dim, float min, float max)
@@ -198,164 +283,465 @@ static void paint_height_map(unsigned char *image, unsigned char *hmap, int dim,
 	}
 }
 
-static void write_image(const char *filename, unsigned char *img, int dim)
+static void write_image(struct threadpool *pool, const struct png_profile *profile,
+			const char *filename, unsigned char *img, int dim, int channels)
 {
 	int rc;
 
-	rc = png_utils_write_png_image(filename, img, dim, dim, 1, 0);
+	trace_begin("png", "write_image", NULL, 0);
+	rc = png_parallel_write_image(pool, filename, profile, img, dim, dim, channels, 0);
+	trace_end("png", "write_image");
 	if (rc)
 		fprintf(stderr, "Failed to write file %s: %s\n", filename, strerror(errno));
 }
 
-static void set_height(unsigned char *heightmap, int x, int y, int h, int dim)
+/* BC4 from the first channel of img, or BC5 from the first two */
+static void write_texture(struct threadpool *pool, int container, int mipmaps, const char *filename,
+			unsigned char *img, int dim, int bpp, int channels)
 {
-	int p, new_height;
+	int rc;
 
-	if (x < 0 || x >= dim)
-		return;
-	if (y < 0 || y >= dim)
-		return;
-	p = y * dim + x;
-	new_height = (int) heightmap[p] + h;
-	if (new_height < 0)
-		new_height = 0;
-	else if (new_height > 255)
-		new_height = 255;
-	heightmap[p] = new_height;
+	trace_begin("texture", "write_texture", NULL, 0);
+	rc = texture_write(pool, filename, container, img, dim, dim, bpp, channels, mipmaps);
+	trace_end("texture", "write_texture");
+	if (rc)
+		fprintf(stderr, "Failed to write file %s: %s\n", filename, strerror(errno));
 }
 
-static void add_groove(unsigned char *heightmap, int dim, int x, int y, int len, int dir, int in_or_out)
+/*
+ * What --stats counts.  Everything that updates these checks for a NULL
+ * stats pointer first, so without --stats counting costs a branch per span
+ * or primitive and nothing per pixel.  Counters are shared by all threads.
+ */
+#define STATS_MAX_DEPTH 64
+
+struct greeble_stats {
+	long areas[STATS_MAX_DEPTH]; /* greeble_area() calls at each recursion depth */
+	long primitives[NPRIMITIVE_TYPES]; /* emitted, by type */
+	long spans; /* spans, columns and boxes drawn */
+	long pixels; /* pixel updates, each of which used to be a set_height() call */
+	long clamped_low, clamped_high; /* pixel updates that clamped at 0 or 255 */
+};
+
+static void count_add(long *counter, long n)
 {
-	int i;
+	if (n)
+		__sync_fetch_and_add(counter, n);
+}
 
-	x -= (len / 2) * xo[dir];
-	y -= (len / 2) * yo[dir];
-	for (i = 0; i < len; i++) {
-		set_height(heightmap, x, y, in_or_out * 30, dim);
-		set_height(heightmap, x + yo[dir], y + xo[dir], in_or_out * 15, dim);
-		set_height(heightmap, x - yo[dir], y - xo[dir], in_or_out * 15, dim);
-		x += xo[dir];
-		y += yo[dir];
+/*
+ * Counts adding h to n bytes of the heightmap starting at p, stride apart,
+ * before it's done.  In accumulation mode clamping happens later.
+ */
+static void count_span(struct greeble_stats *stats, const unsigned char *p, int n,
+			size_t stride, int h, int accumulating)
+{
+	long low = 0, high = 0;
+	int i, v;
+
+	count_add(&stats->spans, 1);
+	count_add(&stats->pixels, n);
+	if (accumulating)
+		return;
+	for (i = 0; i < n; i++, p += stride) {
+		v = *p + h;
+		low += v < 0;
+		high += v > 255;
 	}
+	count_add(&stats->clamped_low, low);
+	count_add(&stats->clamped_high, high);
+}
+
+/*
+ * What --profile measures: the cost in cycle_counter() units of each
+ * primitive drawn, and the pixel updates it made, by kind.  Subdividing a
+ * circle into rings and greebling an area nested in a rectangle are timed
+ * too, from start to finish, so they include the primitives they emit.
+ * Individual costs go into a histogram with PROFILE_SUB_BUCKETS buckets per
+ * power of two, good enough for percentiles to within 1 / PROFILE_SUB_BUCKETS.
+ * Like greeble_stats this is shared by all threads.
+ */
+enum profile_kind {
+	/* The first NPRIMITIVE_TYPES are the primitive types */
+	PROFILE_SUBDIVIDE_CIRCLE = NPRIMITIVE_TYPES,
+	PROFILE_NESTED_AREA,
+	PROFILE_NKINDS,
+};
+
+#define PROFILE_SUB_BITS 3
+#define PROFILE_SUB_BUCKETS (1 << PROFILE_SUB_BITS)
+#define PROFILE_BUCKETS (64 * PROFILE_SUB_BUCKETS)
+
+struct profile_entry {
+	long count;
+	long cost;
+	long pixels;
+	long max;
+	long histogram[PROFILE_BUCKETS];
+};
+
+struct greeble_profile {
+	struct profile_entry kind[PROFILE_NKINDS];
+	int recorded; /* primitives were recorded and drawn later, by tile */
+};
+
+/* Pixel updates made by this thread so far, counted when profiling */
+static __thread long profile_pixels;
+
+static int profile_bucket(uint64_t cost)
+{
+	int log2;
+
+	if (cost < PROFILE_SUB_BUCKETS)
+		return cost;
+	log2 = 63 - __builtin_clzll(cost);
+	return log2 * PROFILE_SUB_BUCKETS + ((cost >> (log2 - PROFILE_SUB_BITS)) & (PROFILE_SUB_BUCKETS - 1));
 }
 
-static void add_random_groove(unsigned char *heightmap, int dim)
+/* The least cost that lands in bucket b */
+static uint64_t profile_bucket_cost(int b)
 {
-	int len, x, y, dir;
-	int in_or_out = 2 * (rand() % 2) - 1;
+	int log2 = b / PROFILE_SUB_BUCKETS;
 
-	dir = rand() % 2;
-	x = rand() % dim;
-	y = rand() % dim;
-	len = rand() % (dim / 2);
+	if (b < PROFILE_SUB_BUCKETS)
+		return b;
+	return (uint64_t) (PROFILE_SUB_BUCKETS + b % PROFILE_SUB_BUCKETS) << (log2 - PROFILE_SUB_BITS);
+}
 
-	add_groove(heightmap, dim, x, y, len, dir, in_or_out);
+static void profile_add(struct greeble_profile *prof, int kind, uint64_t cost, long pixels)
+{
+	struct profile_entry *e = &prof->kind[kind];
+	long old;
+
+	count_add(&e->count, 1);
+	count_add(&e->cost, cost);
+	count_add(&e->pixels, pixels);
+	count_add(&e->histogram[profile_bucket(cost)], 1);
+	do {
+		old = e->max;
+	} while ((long) cost > old && !__sync_bool_compare_and_swap(&e->max, old, (long) cost));
 }
 
-static void add_random_grooves(unsigned char *heightmap, int dim, int count)
+/* The cost that fraction q of e's samples don't exceed, roughly */
+static uint64_t profile_percentile(struct profile_entry *e, double q)
 {
-	int i;
+	long n = 0, want = (long) ceil(q * e->count);
+	int b;
 
-	for (i = 0; i < count; i++)
-		add_random_groove(heightmap, dim);
+	for (b = 0; b < PROFILE_BUCKETS; b++) {
+		n += e->histogram[b];
+		if (n >= want && n > 0)
+			return profile_bucket_cost(b);
+	}
+	return 0;
+}
+
+/*
+ * Everything that greebling needs to get at.  All writes to the heightmap
+ * are confined to the clip rectangle [clipx1, clipx2) x [clipy1, clipy2).
+ * Random numbers come from rng.  When subtree_streams is set, every subtree
+ * of greeble_area() gets a stream and a clip rectangle of its own, see
+ * greeble_child_area().  When pool is not NULL, large subtrees are then run
+ * as tasks on it.  When scene is not NULL, primitives
+ * are appended to it instead of being drawn into the heightmap.
+ */
+struct greeble_context {
+	unsigned char *heightmap;
+	int dim;
+	int clipx1, clipy1, clipx2, clipy2;
+	struct rng *rng;
+	int subtree_streams;
+	struct threadpool *pool;
+	struct display_list *scene;
+	int filled_rings; /* subdivide circles into filled, ringed sectors */
+	int *accum; /* see accumulate_box() */
+	struct greeble_stats *stats; /* NULL unless --stats */
+	struct greeble_profile *profile; /* NULL unless --profile */
+	int depth; /* of greeble_area() recursion */
+};
+
+static void init_greeble_context(struct greeble_context *gc, unsigned char *heightmap, int dim)
+{
+	memset(gc, 0, sizeof(*gc));
+	gc->heightmap = heightmap;
+	gc->dim = dim;
+	gc->clipx2 = dim;
+	gc->clipy2 = dim;
 }
 
-static void greeble_area(unsigned char *heightmap, int dim, int x1, int y1, int x2, int y2, int limit);
-static void add_rectangle(unsigned char *heightmap, int dim, int x, int y, int width, int height, int in_or_out)
+static int greeble_rand(struct greeble_context *gc)
 {
-	int i, j;
-	int lox, hix, loy, hiy;
+	return rng_int(gc->rng);
+}
 
-	lox = x - width / 2;
-	hix = x + width / 2;
-	loy = y - height / 2;
-	hiy = y + height / 2;
+/*
+ * In accumulation mode gc->accum is a dim x dim difference array: the height
+ * added to pixel (x, y) is the sum of accum[j * dim + i] over i <= x, j <= y.
+ * Adding h to a box is then four updates, whatever its size, and the
+ * heightmap is only touched once, by materialize_accumulation() at the end.
+ * Heights are summed without clamping and clamped to 0 .. 255 just once
+ * then, so where panels pile up past the limits the result differs from
+ * drawing them one at a time.
+ *
+ * The corners of a box can be outside gc's clip rectangle, in a neighbor's,
+ * so the updates are atomic.  There are few enough that it doesn't matter.
+ *
+ * Adds h to [x1, x2) x [y1, y2), which must already be clipped.
+ */
+static void accumulate_box(struct greeble_context *gc, int x1, int y1, int x2, int y2, int h)
+{
+	int *a = gc->accum;
+	size_t dim = gc->dim;
+
+	__sync_fetch_and_add(&a[y1 * dim + x1], h);
+	if (x2 < gc->dim)
+		__sync_fetch_and_add(&a[y1 * dim + x2], -h);
+	if (y2 < gc->dim) {
+		__sync_fetch_and_add(&a[y2 * dim + x1], -h);
+		if (x2 < gc->dim)
+			__sync_fetch_and_add(&a[y2 * dim + x2], h);
+	}
+}
+
+/*
+ * Adds h to the height of the pixels [x1, x2) x y that are inside gc's clip
+ * rectangle, clamping to 0 .. 255.  All drawing goes through this,
+ * add_height_column() and add_height_box().
+ */
+static void add_height_span(struct greeble_context *gc, int y, int x1, int x2, int h)
+{
+	if (y < gc->clipy1 || y >= gc->clipy2)
+		return;
+	x1 = max(x1, gc->clipx1);
+	x2 = min(x2, gc->clipx2);
+	if (x1 >= x2)
+		return;
+	if (gc->stats)
+		count_span(gc->stats, &gc->heightmap[(size_t) y * gc->dim + x1], x2 - x1, 1, h,
+				gc->accum != NULL);
+	if (gc->profile)
+		profile_pixels += x2 - x1;
+	if (gc->accum)
+		accumulate_box(gc, x1, y, x2, y + 1, h);
+	else
+		span_add_saturated(&gc->heightmap[(size_t) y * gc->dim + x1], x2 - x1, h);
+}
+
+/* The same for the pixels x * [y1, y2) */
+static void add_height_column(struct greeble_context *gc, int x, int y1, int y2, int h)
+{
+	unsigned char *p;
+	int j;
+
+	if (x < gc->clipx1 || x >= gc->clipx2)
+		return;
+	y1 = max(y1, gc->clipy1);
+	y2 = min(y2, gc->clipy2);
+	if (y1 >= y2)
+		return;
+	p = &gc->heightmap[(size_t) y1 * gc->dim + x];
+	if (gc->stats)
+		count_span(gc->stats, p, y2 - y1, gc->dim, h, gc->accum != NULL);
+	if (gc->profile)
+		profile_pixels += y2 - y1;
+	if (gc->accum) {
+		accumulate_box(gc, x, y1, x + 1, y2, h);
+		return;
+	}
+	for (j = y1; j < y2; j++, p += gc->dim)
+		span_add_saturated(p, 1, h);
+}
+
+/* The same for the pixels [x1, x2) x [y1, y2) */
+static void add_height_box(struct greeble_context *gc, int x1, int y1, int x2, int y2, int h)
+{
+	int j;
 
-	if ((rand() % 5) == 0) {
-		greeble_area(heightmap, dim, lox, loy, hix, hiy, 32);
+	x1 = max(x1, gc->clipx1);
+	x2 = min(x2, gc->clipx2);
+	y1 = max(y1, gc->clipy1);
+	y2 = min(y2, gc->clipy2);
+	if (x1 >= x2 || y1 >= y2)
+		return;
+	if (gc->stats)
+		for (j = y1; j < y2; j++)
+			count_span(gc->stats, &gc->heightmap[(size_t) j * gc->dim + x1], x2 - x1, 1, h,
+					gc->accum != NULL);
+	if (gc->profile)
+		profile_pixels += (long) (x2 - x1) * (y2 - y1);
+	if (gc->accum) {
+		accumulate_box(gc, x1, y1, x2, y2, h);
 		return;
 	}
+	for (j = y1; j < y2; j++)
+		span_add_saturated(&gc->heightmap[(size_t) j * gc->dim + x1], x2 - x1, h);
+}
 
-	for (i = lox + 1; i < hix - 1; i++) {
-		for (j = loy + 1; j < hiy - 1; j++) {
-			set_height(heightmap, i, j, in_or_out * 30, dim);
+/* Turns a band of rows of the difference array into sums along each row */
+static void sum_accumulation_rows(void *context, int band)
+{
+	struct greeble_context *gc = context;
+	int i, j, j1, j2, sum, *a;
+
+	trace_begin("accumulate", "rows", "band", band);
+	j1 = band * ACCUMULATE_BAND_ROWS;
+	j2 = min(j1 + ACCUMULATE_BAND_ROWS, gc->dim);
+	for (j = j1; j < j2; j++) {
+		a = &gc->accum[(size_t) j * gc->dim];
+		sum = 0;
+		for (i = 0; i < gc->dim; i++) {
+			sum += a[i];
+			a[i] = sum;
 		}
 	}
+	trace_end("accumulate", "rows");
+}
 
-	for (i = lox; i < hix; i++) {
-		set_height(heightmap, i, loy, in_or_out * 15, dim);
-		set_height(heightmap, i, hiy, in_or_out * 15, dim);
+/* Sums a strip of columns of the row sums down, and adds the result to the heightmap */
+static void sum_accumulation_columns(void *context, int strip)
+{
+	struct greeble_context *gc = context;
+	int i, i1, i2, j, v, *a, sum[ACCUMULATE_STRIP_COLUMNS];
+	long low = 0, high = 0;
+	unsigned char *h;
+
+	trace_begin("accumulate", "columns", "strip", strip);
+	i1 = strip * ACCUMULATE_STRIP_COLUMNS;
+	i2 = min(i1 + ACCUMULATE_STRIP_COLUMNS, gc->dim);
+	memset(sum, 0, sizeof(sum));
+	for (j = 0; j < gc->dim; j++) {
+		a = &gc->accum[(size_t) j * gc->dim];
+		h = &gc->heightmap[(size_t) j * gc->dim];
+		for (i = i1; i < i2; i++) {
+			sum[i - i1] += a[i];
+			v = h[i] + sum[i - i1];
+			if (v < 0) {
+				v = 0;
+				low++;
+			} else if (v > 255) {
+				v = 255;
+				high++;
+			}
+			h[i] = v;
+		}
 	}
-	for (i = loy; i < hiy; i++) {
-		set_height(heightmap, lox, i, in_or_out * 15, dim);
-		set_height(heightmap, hix, i, in_or_out * 15, dim);
+	if (gc->stats) {
+		count_add(&gc->stats->clamped_low, low);
+		count_add(&gc->stats->clamped_high, high);
 	}
+	trace_end("accumulate", "columns");
 }
 
-static void add_random_rectangle(unsigned char *heightmap, int dim)
+/* Applies everything accumulated in gc->accum to the heightmap, see accumulate_box() */
+static void materialize_accumulation(struct threadpool *pool, struct greeble_context *gc)
 {
-	int x, y, width, height;
-	int in_or_out = 2 * (rand() % 2) - 1;
+	int n;
 
-	x = rand() % dim;
-	y = rand() % dim;
-	width = rand() % 50 + 20;
-	height = rand() % 50 + 20;
+	n = (gc->dim + ACCUMULATE_BAND_ROWS - 1) / ACCUMULATE_BAND_ROWS;
+	threadpool_parallel_for(pool, n, sum_accumulation_rows, gc);
+	n = (gc->dim + ACCUMULATE_STRIP_COLUMNS - 1) / ACCUMULATE_STRIP_COLUMNS;
+	threadpool_parallel_for(pool, n, sum_accumulation_columns, gc);
+}
 
-	add_rectangle(heightmap, dim, x, y, width, height, in_or_out);
+/* A line of 30 with a line of 15 on each side, as runs along the groove */
+static void rasterize_groove(struct greeble_context *gc, int x, int y, int len, int dir, int in_or_out)
+{
+	x -= (len / 2) * xo[dir];
+	y -= (len / 2) * yo[dir];
+	if (dir == 0) {
+		add_height_span(gc, y, x, x + len, in_or_out * 30);
+		add_height_span(gc, y + 1, x, x + len, in_or_out * 15);
+		add_height_span(gc, y - 1, x, x + len, in_or_out * 15);
+	} else {
+		add_height_column(gc, x, y, y + len, in_or_out * 30);
+		add_height_column(gc, x + 1, y, y + len, in_or_out * 15);
+		add_height_column(gc, x - 1, y, y + len, in_or_out * 15);
+	}
 }
 
-static void add_random_rectangles(unsigned char *heightmap, int dim, int count)
+static void greeble_area(struct greeble_context *gc, int x1, int y1, int x2, int y2, int limit);
+static void greeble_nested_area(struct greeble_context *gc, int x1, int y1, int x2, int y2, int limit);
+static void greeble_rectangle_area(struct greeble_context *gc, int x1, int y1, int x2, int y2, int limit);
+/*
+ * Every add a primitive makes has the same sign, so the order in which its
+ * spans are applied doesn't change the result, even where they overlap.
+ */
+static void rasterize_rectangle(struct greeble_context *gc, int x, int y, int width, int height, int in_or_out)
 {
-	int i;
+	int lox, hix, loy, hiy;
 
-	for (i = 0; i < count; i++)
-		add_random_rectangle(heightmap, dim);
+	lox = x - width / 2;
+	hix = x + width / 2;
+	loy = y - height / 2;
+	hiy = y + height / 2;
+
+	add_height_box(gc, lox + 1, loy + 1, hix - 1, hiy - 1, in_or_out * 30);
+
+	/* Border, which leaves out the corner at (hix, hiy) */
+	add_height_span(gc, loy, lox, hix, in_or_out * 15);
+	add_height_span(gc, hiy, lox, hix, in_or_out * 15);
+	add_height_column(gc, lox, loy, hiy, in_or_out * 15);
+	add_height_column(gc, hix, loy, hiy, in_or_out * 15);
 }
 
-static void add_circle(unsigned char *heightmap, int dim, int x, int y, int radius, int in_or_out)
+/*
+ * Fills the pixels (i, j) with (x - i)^2 + (y - j)^2 < radius^2 and i, j in
+ * [x - radius + 1, x + radius - 1).  Each row is one span whose half width is
+ * stepped from the previous row's with integer math only.
+ */
+static void rasterize_circle(struct greeble_context *gc, int x, int y, int radius, int in_or_out)
 {
-	int i, j;
-	int lox, hix, loy, hiy;
-	float d, dx, dy;
-
-	lox = x - radius;
-	hix = x + radius;
-	loy = y - radius;
-	hiy = y + radius;
-
-	for (i = lox + 1; i < hix - 1; i++) {
-		dx = x - i;
-		for (j = loy + 1; j < hiy - 1; j++) {
-			dy = y - j;
-			d = dy * dy + dx * dx;
-			if (d < radius * radius)
-				set_height(heightmap, i, j, in_or_out * 20, dim);
-		}
+	int j, j1, j2, dy, rem, w;
+	int lox, hix;
+
+	if (radius <= 0)
+		return;
+	lox = x - radius + 1;
+	hix = x + radius - 1;
+	j1 = max(y - radius + 1, gc->clipy1);
+	j2 = min(y + radius - 1, gc->clipy2);
+	w = 0;
+	for (j = j1; j < j2; j++) {
+		dy = y - j;
+		/* largest w with w^2 < rem, rem >= 2 * radius - 1 so w = 0 always fits */
+		rem = radius * radius - dy * dy;
+		while ((w + 1) * (w + 1) < rem)
+			w++;
+		while (w * w >= rem)
+			w--;
+		add_height_span(gc, j, max(x - w, lox), min(x + w + 1, hix), in_or_out * 20);
 	}
 }
 
 struct bline_context {
-	unsigned char *heightmap;
-	int dim;
+	struct greeble_context *gc;
 	int in_or_out;
 };
 
-static void plot_point(int x, int y, void *context)
+static void plot_run(int x, int y, int len, int vertical, void *context)
 {
 	struct bline_context *c = context;
 
-	set_height(c->heightmap, x, y, c->in_or_out * 20, c->dim);
+	if (vertical)
+		add_height_column(c->gc, x, y, y + len, c->in_or_out * 20);
+	else
+		add_height_span(c->gc, y, x, x + len, c->in_or_out * 20);
 }
 
-static void add_annulus_sector(unsigned char *heightmap, int dim, int x, int y,
-				float a1, float a2, int r1, int r2, int in_or_out, int limit)
+static void outline_edge(struct bline_context *c, int x1, int y1, int x2, int y2)
+{
+	struct greeble_context *gc = c->gc;
+
+	bline_clipped(x1, y1, x2, y2, gc->clipx1, gc->clipy1, gc->clipx2, gc->clipy2, plot_run, c);
+}
+
+static void rasterize_annulus_sector(struct greeble_context *gc, int x, int y,
+				float a1, float a2, int r1, int r2, int in_or_out)
 {
 	struct bline_context c;
 	int x1, y1, x2, y2, x3, y3, x4, y4;
 
-	c.heightmap = heightmap;
-	c.dim = dim;
+	c.gc = gc;
 	c.in_or_out = in_or_out;
 
 	x1 = x + cos(a1) * r1;
@@ -367,131 +753,665 @@ static void add_annulus_sector(unsigned char *heightmap, int dim, int x, int y,
 	x4 = x + cos(a2) * r2;
 	y4 = y - sin(a2) * r2;
 
-	bline(x1, y1, x2, y2, plot_point, &c);
-	bline(x2, y2, x4, y4, plot_point, &c);
-	bline(x4, y4, x3, y3, plot_point, &c);
-	bline(x3, y3, x1, y1, plot_point, &c);
+	outline_edge(&c, x1, y1, x2, y2);
+	outline_edge(&c, x2, y2, x4, y4);
+	outline_edge(&c, x4, y4, x3, y3);
+	outline_edge(&c, x3, y3, x1, y1);
+}
+
+/*
+ * The pixels px, relative to the centre, of the row py pixels above the centre
+ * that are on or to the left of the ray at angle a (left = 1), or strictly to
+ * its right (left = 0), as the range lo .. hi, limited to -big .. big.  The
+ * two sides of a ray always split the row exactly, so sectors sharing an
+ * edge neither overlap nor leave gaps.
+ */
+static void ray_side(float a, int py, int big, int left, int *lo, int *hi)
+{
+	double s = sin(a), c = cos(a), t;
+
+	*lo = -big;
+	*hi = big;
+	if (s == 0.0) {
+		if ((c * py >= 0.0) != left) {
+			*lo = 1;
+			*hi = 0;
+		}
+		return;
+	}
+	/* c * py - s * px >= 0 */
+	t = c * py / s;
+	if (t < -big - 1)
+		t = -big - 1;
+	else if (t > big + 1)
+		t = big + 1;
+	if (s > 0.0) {
+		if (left)
+			*hi = (int) floor(t);
+		else
+			*lo = (int) floor(t) + 1;
+	} else {
+		if (left)
+			*lo = (int) ceil(t);
+		else
+			*hi = (int) ceil(t) - 1;
+	}
+}
+
+/*
+ * Part of the row py above the centre inside the sector going counterclockwise
+ * from a1 to a2, as up to two ranges of px.  Returns how many.
+ */
+static int sector_row(float a1, float a2, int py, int big, int lo[2], int hi[2])
+{
+	if (a2 - a1 >= 2.0 * M_PI) {
+		lo[0] = -big;
+		hi[0] = big;
+		return 1;
+	}
+	ray_side(a1, py, big, 1, &lo[0], &hi[0]);
+	ray_side(a2, py, big, 0, &lo[1], &hi[1]);
+	if (a2 - a1 <= M_PI) {
+		/* Left of a1 and right of a2 */
+		lo[0] = max(lo[0], lo[1]);
+		hi[0] = min(hi[0], hi[1]);
+		return 1;
+	}
+	/* Left of a1 or right of a2, merged if they touch */
+	if (lo[1] <= hi[0] + 1 && lo[0] <= hi[1] + 1) {
+		lo[0] = min(lo[0], lo[1]);
+		hi[0] = max(hi[0], hi[1]);
+		return 1;
+	}
+	return 2;
+}
+
+/* Largest w with w^2 < r^2 - py^2, or -1 if there is none */
+static int ring_half_width(int r, int py)
+{
+	int rem = r * r - py * py;
+	int w;
+
+	if (rem <= 0)
+		return -1;
+	w = (int) sqrt((double) rem);
+	while (w * w >= rem)
+		w--;
+	while ((w + 1) * (w + 1) < rem)
+		w++;
+	return w;
+}
+
+/*
+ * Fills the part of the annulus r1 <= d < r2 between angles a1 and a2 one
+ * scanline at a time.  The annulus is cut into rings concentric bands of equal
+ * width, alternately raised by 20 and 10, outermost first, which gives
+ * concentric ring stacks in a single pass.
+ */
+static void rasterize_filled_annulus_sector(struct greeble_context *gc, int x, int y,
+				float a1, float a2, int r1, int r2, int rings, int in_or_out)
+{
+	int j, j1, j2, py, k, n, m, h, outer_w, inner_w, rb;
+	int lo[2], hi[2], slo[2], shi[2], l, r;
+
+	if (r2 <= 0 || r2 <= r1 || a2 <= a1)
+		return;
+	r1 = max(r1, 0);
+	if (rings < 1)
+		rings = 1;
+	if (rings > r2 - r1)
+		rings = r2 - r1;
+	j1 = max(y - r2 + 1, gc->clipy1);
+	j2 = min(y + r2, gc->clipy2);
+	for (j = j1; j < j2; j++) {
+		py = y - j;
+		n = sector_row(a1, a2, py, r2, lo, hi);
+		outer_w = ring_half_width(r2, py);
+		for (k = 0; k < rings && outer_w >= 0; k++) {
+			rb = r2 - (int) ((long long) (r2 - r1) * (k + 1) / rings);
+			inner_w = ring_half_width(rb, py);
+			h = in_or_out * ((k & 1) ? 10 : 20);
+			/* The band is -outer_w .. -inner_w - 1 and inner_w + 1 .. outer_w,
+			 * split at the centre column when there's no hole in this row */
+			slo[0] = -outer_w;
+			shi[0] = min(-inner_w - 1, -1);
+			slo[1] = inner_w + 1;
+			shi[1] = outer_w;
+			for (m = 0; m < 2 * n; m++) {
+				l = max(slo[m / n], lo[m % n]);
+				r = min(shi[m / n], hi[m % n]);
+				if (l <= r)
+					add_height_span(gc, j, x + l, x + r + 1, h);
+			}
+			outer_w = inner_w;
+		}
+	}
+}
+
+/*
+ * Everything p draws is within rx pixels of p->x and ry pixels of p->y.
+ * Returns 0 for unknown types.  These only need to be conservative.
+ */
+static int primitive_extent(struct primitive *p, int *rx, int *ry)
+{
+	/* Sizes can come out negative, a rectangle then still draws its border rows */
+	switch (p->type) {
+	case LINE:
+		*rx = abs(p->p.line.len) / 2 + 1;
+		*ry = 1;
+		if (p->p.line.dir) {
+			*ry = *rx;
+			*rx = 1;
+		}
+		break;
+	case RECTANGLE:
+		*rx = abs(p->p.rectangle.w) / 2;
+		*ry = abs(p->p.rectangle.h) / 2;
+		break;
+	case CIRCLE:
+		*rx = abs(p->p.circle.r);
+		*ry = *rx;
+		break;
+	case ANNULUS_SECTOR:
+	case FILLED_ANNULUS_SECTOR:
+		*rx = max(abs(p->p.annulus_sector.inner_r), abs(p->p.annulus_sector.outer_r)) + 1;
+		*ry = *rx;
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+/* Draws p with gc's clip rectangle, ignoring p's */
+static void rasterize_shape(struct greeble_context *gc, struct primitive *p)
+{
+	switch (p->type) {
+	case LINE:
+		rasterize_groove(gc, p->x, p->y, p->p.line.len, p->p.line.dir, p->in_or_out);
+		break;
+	case RECTANGLE:
+		rasterize_rectangle(gc, p->x, p->y, p->p.rectangle.w, p->p.rectangle.h, p->in_or_out);
+		break;
+	case CIRCLE:
+		rasterize_circle(gc, p->x, p->y, p->p.circle.r, p->in_or_out);
+		break;
+	case ANNULUS_SECTOR:
+		rasterize_annulus_sector(gc, p->x, p->y,
+			p->p.annulus_sector.a1, p->p.annulus_sector.a2,
+			p->p.annulus_sector.inner_r, p->p.annulus_sector.outer_r, p->in_or_out);
+		break;
+	case FILLED_ANNULUS_SECTOR:
+		rasterize_filled_annulus_sector(gc, p->x, p->y,
+			p->p.annulus_sector.a1, p->p.annulus_sector.a2,
+			p->p.annulus_sector.inner_r, p->p.annulus_sector.outer_r,
+			p->p.annulus_sector.rings, p->in_or_out);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Draws a display list primitive, clipped to both its own and gc's clip rectangle */
+static void draw_primitive(struct greeble_context *gc, struct primitive *p)
+{
+	struct greeble_context clipped = *gc;
+
+	clipped.clipx1 = max(gc->clipx1, p->clipx1);
+	clipped.clipy1 = max(gc->clipy1, p->clipy1);
+	clipped.clipx2 = min(gc->clipx2, p->clipx2);
+	clipped.clipy2 = min(gc->clipy2, p->clipy2);
+
+	rasterize_shape(&clipped, p);
+}
+
+/* The same, timing it when profiling */
+static void rasterize_primitive(struct greeble_context *gc, struct primitive *p)
+{
+	uint64_t start;
+	long pixels;
+
+	if (!gc->profile || p->type < 0 || p->type >= NPRIMITIVE_TYPES) {
+		draw_primitive(gc, p);
+		return;
+	}
+	pixels = profile_pixels;
+	start = cycle_counter();
+	draw_primitive(gc, p);
+	profile_add(gc->profile, p->type, cycle_counter() - start, profile_pixels - pixels);
+}
+
+static void rasterize_display_list(struct greeble_context *gc, struct display_list *dl)
+{
+	int i;
+
+	for (i = 0; i < dl->nprimitives; i++)
+		rasterize_primitive(gc, &dl->p[i]);
+}
+
+/*
+ * Inclusive bounds of the pixels p can touch, clipped to its clip rectangle.
+ * Returns 0 if it can't touch any.
+ */
+static int primitive_bounds(struct primitive *p, int *x1, int *y1, int *x2, int *y2)
+{
+	int rx, ry;
+
+	if (!primitive_extent(p, &rx, &ry))
+		return 0;
+	*x1 = max(p->x - rx, p->clipx1);
+	*y1 = max(p->y - ry, p->clipy1);
+	*x2 = min(p->x + rx, p->clipx2 - 1);
+	*y2 = min(p->y + ry, p->clipy2 - 1);
+	return *x1 <= *x2 && *y1 <= *y2;
+}
+
+/*
+ * The primitives of a display list sorted into tiles.  The primitives
+ * overlapping tile t are dl->p[index[first[t]]] .. dl->p[index[first[t + 1] - 1]],
+ * in display list order.
+ */
+struct tile_bins {
+	struct greeble_context *gc;
+	struct display_list *dl;
+	int tiles_across, ntiles;
+	int *first;
+	int *index;
+};
+
+static void bin_display_list(struct tile_bins *b)
+{
+	int i, tx, ty, t, x1, y1, x2, y2, total;
+	int *fill;
+
+	b->first = calloc(b->ntiles + 1, sizeof(*b->first));
+	fill = calloc(b->ntiles, sizeof(*fill));
+	if (!b->first || !fill)
+		goto oom;
+
+	/* Count the primitives in each tile, then lay the tiles out back to back */
+	for (i = 0; i < b->dl->nprimitives; i++) {
+		if (!primitive_bounds(&b->dl->p[i], &x1, &y1, &x2, &y2))
+			continue;
+		for (ty = y1 / RASTER_TILE_SIZE; ty <= y2 / RASTER_TILE_SIZE; ty++)
+			for (tx = x1 / RASTER_TILE_SIZE; tx <= x2 / RASTER_TILE_SIZE; tx++)
+				b->first[ty * b->tiles_across + tx + 1]++;
+	}
+	for (t = 0; t < b->ntiles; t++)
+		b->first[t + 1] += b->first[t];
+	total = b->first[b->ntiles];
+
+	b->index = malloc(sizeof(*b->index) * (total ? total : 1));
+	if (!b->index)
+		goto oom;
+	for (i = 0; i < b->dl->nprimitives; i++) {
+		if (!primitive_bounds(&b->dl->p[i], &x1, &y1, &x2, &y2))
+			continue;
+		for (ty = y1 / RASTER_TILE_SIZE; ty <= y2 / RASTER_TILE_SIZE; ty++)
+			for (tx = x1 / RASTER_TILE_SIZE; tx <= x2 / RASTER_TILE_SIZE; tx++) {
+				t = ty * b->tiles_across + tx;
+				b->index[b->first[t] + fill[t]++] = i;
+			}
+	}
+	free(fill);
+	return;
+
+oom:
+	fprintf(stderr, "Out of memory binning scene\n");
+	exit(1);
+}
+
+static void rasterize_tile(void *context, int tile)
+{
+	struct tile_bins *b = context;
+	struct greeble_context gc = *b->gc;
+	int i, tx, ty;
+
+	tx = (tile % b->tiles_across) * RASTER_TILE_SIZE;
+	ty = (tile / b->tiles_across) * RASTER_TILE_SIZE;
+	gc.clipx1 = max(gc.clipx1, tx);
+	gc.clipy1 = max(gc.clipy1, ty);
+	gc.clipx2 = min(gc.clipx2, tx + RASTER_TILE_SIZE);
+	gc.clipy2 = min(gc.clipy2, ty + RASTER_TILE_SIZE);
+	trace_begin("raster", "tile", "primitives", b->first[tile + 1] - b->first[tile]);
+	for (i = b->first[tile]; i < b->first[tile + 1]; i++)
+		rasterize_primitive(&gc, &b->dl->p[b->index[i]]);
+	trace_end("raster", "tile");
+}
+
+/*
+ * Same result as rasterize_display_list(), but in parallel.  Each tile is
+ * drawn by one worker, which draws the primitives overlapping it in display
+ * list order, clipped to the tile.  No two workers ever write the same pixel,
+ * and every pixel sees the same sequence of saturating adds as in a serial
+ * replay.
+ */
+static void rasterize_display_list_tiled(struct threadpool *pool, struct greeble_context *gc,
+				struct display_list *dl)
+{
+	struct tile_bins b;
+
+	/* Accumulating is cheap, and box corners can land in other tiles */
+	if (threadpool_nthreads(pool) == 1 || gc->accum) {
+		rasterize_display_list(gc, dl);
+		return;
+	}
+	b.gc = gc;
+	b.dl = dl;
+	b.tiles_across = (gc->dim + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+	b.ntiles = b.tiles_across * b.tiles_across;
+	bin_display_list(&b);
+	threadpool_parallel_for(pool, b.ntiles, rasterize_tile, &b);
+	free(b.index);
+	free(b.first);
+}
+
+/* Either records p in gc's scene or draws it right away */
+static void emit_primitive(struct greeble_context *gc, struct primitive *p)
+{
+	p->clipx1 = gc->clipx1;
+	p->clipy1 = gc->clipy1;
+	p->clipx2 = gc->clipx2;
+	p->clipy2 = gc->clipy2;
+	if (gc->stats && p->type >= 0 && p->type < NPRIMITIVE_TYPES)
+		count_add(&gc->stats->primitives[p->type], 1);
+	if (!gc->scene) {
+		rasterize_primitive(gc, p);
+		return;
+	}
+	if (display_list_append(gc->scene, p)) {
+		fprintf(stderr, "Out of memory recording scene\n");
+		exit(1);
+	}
+}
+
+static void add_groove(struct greeble_context *gc, int x, int y, int len, int dir, int in_or_out)
+{
+	struct primitive p;
+
+	p.type = LINE;
+	p.x = x;
+	p.y = y;
+	p.p.line.len = len;
+	p.p.line.dir = dir;
+	p.in_or_out = in_or_out;
+	emit_primitive(gc, &p);
+}
+
+static void add_rectangle(struct greeble_context *gc, int x, int y, int width, int height, int in_or_out)
+{
+	struct primitive p;
+
+	if ((greeble_rand(gc) % 5) == 0) {
+		greeble_rectangle_area(gc, x - width / 2, y - height / 2, x + width / 2, y + height / 2, 32);
+		return;
+	}
+	p.type = RECTANGLE;
+	p.x = x;
+	p.y = y;
+	p.p.rectangle.w = width;
+	p.p.rectangle.h = height;
+	p.in_or_out = in_or_out;
+	emit_primitive(gc, &p);
+}
+
+static void add_circle(struct greeble_context *gc, int x, int y, int radius, int in_or_out)
+{
+	struct primitive p;
+
+	p.type = CIRCLE;
+	p.x = x;
+	p.y = y;
+	p.p.circle.r = radius;
+	p.in_or_out = in_or_out;
+	emit_primitive(gc, &p);
+}
+
+static void add_annulus_sector(struct greeble_context *gc, int x, int y,
+				float a1, float a2, int r1, int r2, int in_or_out)
+{
+	struct primitive p;
+
+	p.type = ANNULUS_SECTOR;
+	p.x = x;
+	p.y = y;
+	p.p.annulus_sector.a1 = a1;
+	p.p.annulus_sector.a2 = a2;
+	p.p.annulus_sector.inner_r = r1;
+	p.p.annulus_sector.outer_r = r2;
+	p.in_or_out = in_or_out;
+	emit_primitive(gc, &p);
+}
+
+static void add_filled_annulus_sector(struct greeble_context *gc, int x, int y,
+				float a1, float a2, int r1, int r2, int rings, int in_or_out)
+{
+	struct primitive p;
+
+	p.type = FILLED_ANNULUS_SECTOR;
+	p.x = x;
+	p.y = y;
+	p.p.annulus_sector.a1 = a1;
+	p.p.annulus_sector.a2 = a2;
+	p.p.annulus_sector.inner_r = r1;
+	p.p.annulus_sector.outer_r = r2;
+	p.p.annulus_sector.rings = rings;
+	p.in_or_out = in_or_out;
+	emit_primitive(gc, &p);
+}
+
+static void add_random_groove(struct greeble_context *gc)
+{
+	int len, x, y, dir;
+	int in_or_out = 2 * (greeble_rand(gc) % 2) - 1;
+
+	dir = greeble_rand(gc) % 2;
+	x = greeble_rand(gc) % gc->dim;
+	y = greeble_rand(gc) % gc->dim;
+	len = greeble_rand(gc) % (gc->dim / 2);
+
+	add_groove(gc, x, y, len, dir, in_or_out);
+}
+
+static void add_random_grooves(struct greeble_context *gc, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		add_random_groove(gc);
+}
+
+static void add_random_rectangle(struct greeble_context *gc)
+{
+	int x, y, width, height;
+	int in_or_out = 2 * (greeble_rand(gc) % 2) - 1;
+
+	x = greeble_rand(gc) % gc->dim;
+	y = greeble_rand(gc) % gc->dim;
+	width = greeble_rand(gc) % 50 + 20;
+	height = greeble_rand(gc) % 50 + 20;
+
+	add_rectangle(gc, x, y, width, height, in_or_out);
+}
+
+static void add_random_rectangles(struct greeble_context *gc, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		add_random_rectangle(gc);
 }
 
-static void add_random_circle(unsigned char *heightmap, int dim)
+static void add_random_circle(struct greeble_context *gc)
 {
 	int x, y, radius;
-	int in_or_out = 2 * (rand() % 2) - 1;
+	int in_or_out = 2 * (greeble_rand(gc) % 2) - 1;
 
-	x = rand() % dim;
-	y = rand() % dim;
-	radius = rand() % 50 + 20;
+	x = greeble_rand(gc) % gc->dim;
+	y = greeble_rand(gc) % gc->dim;
+	radius = greeble_rand(gc) % 50 + 20;
 
-	add_circle(heightmap, dim, x, y, radius, in_or_out);
+	add_circle(gc, x, y, radius, in_or_out);
 }
 
-static void add_random_circles(unsigned char *heightmap, int dim, int count)
+static void add_random_circles(struct greeble_context *gc, int count)
 {
 	int i;
 
 	for (i = 0; i < count; i++)
-		add_random_circle(heightmap, dim);
+		add_random_circle(gc);
+}
+
+/*
+ * Like subdivide_circle(), but the whole stack of nested rings becomes one
+ * ring of filled sectors, each with a band per nested ring, and a narrow slot
+ * between neighboring sectors.
+ */
+static void subdivide_circle_filled(struct greeble_context *gc, int x, int y, int r, int in_or_out, int limit)
+{
+	float ainc, a2, a1 = 0, slot;
+	int r1, rings;
+
+	r1 = r * (((float) (greeble_rand(gc) % 50) + 30.0) / 100.0);
+	rings = 1;
+	while (r1 * 2 > limit) {
+		r1 = r1 * (((float) (greeble_rand(gc) % 50) + 30.0) / 100.0);
+		rings++;
+	}
+	slot = 2.0 / r;
+	a2 = a1;
+	do {
+		ainc = 2.0 * M_PI / ((greeble_rand(gc) % 10) + 10);
+		a2 = a2 + ainc;
+		if (a2 > 2.0 * M_PI) {
+			a2 = 2.0 * M_PI;
+			break;
+		}
+		add_filled_annulus_sector(gc, x, y, a1, a2 - slot, r1, r, rings, in_or_out);
+		a1 = a2;
+	} while (a1 < 2.0 * M_PI);
 }
 
-static void subdivide_circle(unsigned char *heightmap, int dim, int x, int y, int r, int in_or_out, int limit)
+static void subdivide_circle(struct greeble_context *gc, int x, int y, int r, int in_or_out, int limit)
 {
 	float ainc, a2, a1 = 0;
 	int r1, r2;
 
-	r1 = r * (((float) (rand() % 50) + 30.0) / 100.0);
+	if (gc->filled_rings) {
+		subdivide_circle_filled(gc, x, y, r, in_or_out, limit);
+		return;
+	}
+	r1 = r * (((float) (greeble_rand(gc) % 50) + 30.0) / 100.0);
 	r2 = r;
 	a2 = a1;
 	do {
-		ainc = 2.0 * M_PI / ((rand() % 10) + 10);
+		ainc = 2.0 * M_PI / ((greeble_rand(gc) % 10) + 10);
 		a2 = a2 + ainc;
 		if (a2 > 2.0 * M_PI) {
 			a2 = 2.0 * M_PI;
 			break;
 		}
-		add_annulus_sector(heightmap, dim, x, y, a1, a2, r1, r2, in_or_out, limit);
+		add_annulus_sector(gc, x, y, a1, a2, r1, r2, in_or_out);
 		a1 = a2;
 	} while (a1 < 2.0 * M_PI);
 	if (r1 * 2 > limit)
-		subdivide_circle(heightmap, dim, x, y, r1, in_or_out, limit);
+		subdivide_circle(gc, x, y, r1, in_or_out, limit);
 }
 
-static void add_primitive(unsigned char *heightmap, int dim, struct primitive *p, int limit)
+static void profiled_subdivide_circle(struct greeble_context *gc, int x, int y, int r,
+					int in_or_out, int limit)
+{
+	uint64_t start;
+	long pixels;
+
+	if (!gc->profile) {
+		subdivide_circle(gc, x, y, r, in_or_out, limit);
+		return;
+	}
+	pixels = profile_pixels;
+	start = cycle_counter();
+	subdivide_circle(gc, x, y, r, in_or_out, limit);
+	profile_add(gc->profile, PROFILE_SUBDIVIDE_CIRCLE, cycle_counter() - start,
+			profile_pixels - pixels);
+}
+
+static void add_primitive(struct greeble_context *gc, struct primitive *p, int limit)
 {
 	switch (p->type) {
 	case LINE:
-		add_groove(heightmap, dim, p->x, p->y, p->p.line.len, p->p.line.dir, p->in_or_out);
+		add_groove(gc, p->x, p->y, p->p.line.len, p->p.line.dir, p->in_or_out);
 		break;
 	case RECTANGLE:
-		add_rectangle(heightmap, dim, p->x, p->y, p->p.rectangle.w, p->p.rectangle.h, p->in_or_out);
+		add_rectangle(gc, p->x, p->y, p->p.rectangle.w, p->p.rectangle.h, p->in_or_out);
 		break;
 	case CIRCLE:
-		add_circle(heightmap, dim, p->x, p->y, p->p.circle.r, p->in_or_out);
+		add_circle(gc, p->x, p->y, p->p.circle.r, p->in_or_out);
 		if (p->p.circle.r * 2 > limit)
-			subdivide_circle(heightmap, dim, p->x, p->y, p->p.circle.r, p->in_or_out, limit);
+			profiled_subdivide_circle(gc, p->x, p->y, p->p.circle.r, p->in_or_out, limit);
 		break;
 	case ANNULUS_SECTOR:
-		add_annulus_sector(heightmap, dim, p->x, p->y,
+		add_annulus_sector(gc, p->x, p->y,
 			p->p.annulus_sector.a1, p->p.annulus_sector.a2,
-			p->p.annulus_sector.inner_r, p->p.annulus_sector.outer_r, p->in_or_out, limit);
+			p->p.annulus_sector.inner_r, p->p.annulus_sector.outer_r, p->in_or_out);
 		break;
 	default:
 		break;
 	}
 }
 
-static void add_row_of_primitives(unsigned char *heightmap, int dim, int dir, int count, int inc, struct primitive *p, int limit)
+static void add_row_of_primitives(struct greeble_context *gc, int dir, int count, int inc, struct primitive *p, int limit)
 {
 	int i;
 
 	for (i = 0; i < count; i++) {
-		add_primitive(heightmap, dim, p, limit);
+		add_primitive(gc, p, limit);
 		p->x += xo[dir] * inc;
 		p->y += yo[dir] * inc;
 	}
 }
 
-static void add_random_row_of_random_primitives(unsigned char *heightmap, int dim, int limit)
+static void add_random_row_of_random_primitives(struct greeble_context *gc, int limit)
 {
 	int dir, inc, count;
 	struct primitive p;
 
-	count = rand() % 7 + 3;
-	dir = rand() % 2;
-	p.type = rand() % 3;
-	p.x = rand() % dim;
-	p.y = rand() % dim;
-	p.in_or_out = 2 * (rand() % 2) - 1;
+	count = greeble_rand(gc) % 7 + 3;
+	dir = greeble_rand(gc) % 2;
+	p.type = greeble_rand(gc) % 3;
+	p.x = greeble_rand(gc) % gc->dim;
+	p.y = greeble_rand(gc) % gc->dim;
+	p.in_or_out = 2 * (greeble_rand(gc) % 2) - 1;
 
 	switch (p.type) {
 	case CIRCLE:
-		p.p.circle.r = rand() % 35 + 5;
+		p.p.circle.r = greeble_rand(gc) % 35 + 5;
 		inc = p.p.circle.r * 2.3;
 		break;
 	case RECTANGLE:
-		p.p.rectangle.w = rand() % 35 + 5;
-		p.p.rectangle.h = rand() % 35 + 5;
+		p.p.rectangle.w = greeble_rand(gc) % 35 + 5;
+		p.p.rectangle.h = greeble_rand(gc) % 35 + 5;
 		inc = 1.2 * max(p.p.rectangle.w, p.p.rectangle.h);
 		break;
 	case LINE:
-		p.p.line.len = rand() % (dim / 2);
+		p.p.line.len = greeble_rand(gc) % (gc->dim / 2);
 		p.p.line.dir = !dir;
 		inc = 5;
 		break;
 	default:
 		break;
 	}
-	add_row_of_primitives(heightmap, dim, dir, count, inc, &p, limit);
+	add_row_of_primitives(gc, dir, count, inc, &p, limit);
 }
 
-static void add_random_rows(unsigned char *heightmap, int dim, int count, int limit)
+static void add_random_rows(struct greeble_context *gc, int count, int limit)
 {
 	int i;
 
 	for (i = 0; i < count; i++)
-		add_random_row_of_random_primitives(heightmap, dim, limit);
+		add_random_row_of_random_primitives(gc, limit);
 }
 
-static void populate_rects(unsigned char *heightmap, int dim, int x1, int y1, int x2, int y2,
+static void populate_rects(struct greeble_context *gc, int x1, int y1, int x2, int y2,
 				__attribute__((unused)) int limit)
 {
 	int dx, dy;
@@ -500,23 +1420,23 @@ static void populate_rects(unsigned char *heightmap, int dim, int x1, int y1, in
 
 	dx = abs(x2 - x1) - 10;
 	dy = abs(y2 - y1) - 10;
-	dir = rand() % 2;
-	count = rand() % 10;
+	dir = greeble_rand(gc) % 2;
+	count = greeble_rand(gc) % 10;
 	if (!count)
 		return;
 	incx = (xo[dir] * dx) / count;
 	incy = (yo[dir] * dy) / count;
 
-	p.in_or_out = 2 * (rand() % 2) - 1;
+	p.in_or_out = 2 * (greeble_rand(gc) % 2) - 1;
 	p.type = RECTANGLE;
 	p.x = x1 + dx * yo[dir] / 2 + incx * xo[dir] / 2 + 5;
 	p.y = y1 + dy * xo[dir] / 2 + incy * yo[dir] / 2 + 5;
 	p.p.rectangle.w = incx + yo[dir] * dx;
 	p.p.rectangle.h = incy + xo[dir] * dy;
-	add_row_of_primitives(heightmap, dim, dir, count, incx + incy, &p, limit);
+	add_row_of_primitives(gc, dir, count, incx + incy, &p, limit);
 }
 
-static void populate_circles(unsigned char *heightmap, int dim, int x1, int y1, int x2, int y2, int limit)
+static void populate_circles(struct greeble_context *gc, int x1, int y1, int x2, int y2, int limit)
 {
 	int dx, dy;
 	int count, dir, incx, incy, r;
@@ -527,7 +1447,7 @@ static void populate_circles(unsigned char *heightmap, int dim, int x1, int y1,
 	dy = abs(y2 - y1);
 	if (dx < limit || dy < limit)
 		return;
-	dir = rand() % 2;
+	dir = greeble_rand(gc) % 2;
 
 	if (dx > dy) {
 		count = dx / dy;
@@ -543,112 +1463,836 @@ static void populate_circles(unsigned char *heightmap, int dim, int x1, int y1,
 	incx = (xo[dir] * dy);
 	incy = (yo[dir] * dx);
 
-	p.in_or_out = 2 * (rand() % 2) - 1;
+	p.in_or_out = 2 * (greeble_rand(gc) % 2) - 1;
 	p.type = CIRCLE;
 	p.x = x1 + dx * yo[dir] / 2 + incx * xo[dir] / 2;
 	p.y = y1 + dy * xo[dir] / 2 + incy * yo[dir] / 2;
 	p.p.circle.r = r;
-	add_row_of_primitives(heightmap, dim, dir, count, incx + incy, &p, limit);
+	add_row_of_primitives(gc, dir, count, incx + incy, &p, limit);
 	if (remainder > limit) {
 		x1 = x1 + incx * count * xo[dir];
 		y1 = y1 + incy * count * yo[dir];
-		greeble_area(heightmap, dim, x1, y1, x2, y2, limit);
+		greeble_nested_area(gc, x1, y1, x2, y2, limit);
 	}
 }
 
-static void populate_greebles(unsigned char *heightmap, int dim, int x1, int y1, int x2, int y2, int limit)
+static void populate_greebles(struct greeble_context *gc, int x1, int y1, int x2, int y2, int limit)
 {
 	int c;
 
 	c = 0;
 
-	c = rand() % 4;
+	c = greeble_rand(gc) % 4;
 
 	switch (c) {
 	case 0:
 	case 1:
 	case 2:
-		populate_rects(heightmap, dim, x1, y1, x2, y2, limit);
+		populate_rects(gc, x1, y1, x2, y2, limit);
 		break;
 	case 3:
-		populate_circles(heightmap, dim, x1, y1, x2, y2, limit);
+		populate_circles(gc, x1, y1, x2, y2, limit);
 		break;
 	default:
 		break;
 	}
 }
 
-static void greeble_area(unsigned char *heightmap, int dim, int x1, int y1, int x2, int y2, int limit)
+struct greeble_task {
+	struct greeble_context gc;
+	struct rng rng;
+	int x1, y1, x2, y2, limit;
+};
+
+static void greeble_task(void *arg)
+{
+	struct greeble_task *t = arg;
+
+	trace_begin("greeble", "subtree", "pixels", (long) abs(t->x2 - t->x1) * abs(t->y2 - t->y1));
+	greeble_area(&t->gc, t->x1, t->y1, t->x2, t->y2, t->limit);
+	trace_end("greeble", "subtree");
+	free(t);
+}
+
+/*
+ * Greebles one of the two halves of an area that was split at "split" by a
+ * groove running in direction dir (1 = vertical, so the split is on x).
+ *
+ * With a single random number stream there's nothing to do but recurse.
+ * With per-subtree streams the child gets its own stream, split off the
+ * parent's, and a clip rectangle covering only its own side of the split, so that its
+ * writes can never touch pixels belonging to its sibling or to anything
+ * else that might be running at the same time.  The parent's groove is
+ * already done by now and the parent writes nothing after its children, so
+ * a child running as a task sees exactly what it would see inline, and the
+ * output doesn't depend on the number of threads or on scheduling.
+ */
+static void greeble_child_area(struct greeble_context *gc, int x1, int y1, int x2, int y2,
+				int limit, int split, int dir)
+{
+	struct greeble_context child;
+	struct greeble_task *t;
+	struct rng child_rng;
+
+	if (!gc->subtree_streams) {
+		greeble_area(gc, x1, y1, x2, y2, limit);
+		return;
+	}
+
+	child = *gc;
+	rng_split(gc->rng, &child_rng);
+	child.rng = &child_rng;
+	if (dir == 1) {
+		if (min(x1, x2) < split)
+			child.clipx2 = min(child.clipx2, split);
+		else
+			child.clipx1 = max(child.clipx1, split);
+	} else {
+		if (min(y1, y2) < split)
+			child.clipy2 = min(child.clipy2, split);
+		else
+			child.clipy1 = max(child.clipy1, split);
+	}
+
+	if (gc->pool && abs(x2 - x1) * abs(y2 - y1) >= GREEBLE_TASK_AREA) {
+		t = malloc(sizeof(*t));
+		if (!t) {
+			fprintf(stderr, "Out of memory greebling\n");
+			exit(1);
+		}
+		t->gc = child;
+		t->rng = child_rng;
+		t->gc.rng = &t->rng;
+		t->x1 = x1;
+		t->y1 = y1;
+		t->x2 = x2;
+		t->y2 = y2;
+		t->limit = limit;
+		threadpool_submit(gc->pool, greeble_task, t);
+		return;
+	}
+	greeble_area(&child, x1, y1, x2, y2, limit);
+}
+
+/*
+ * Greebles an area from inside a primitive.  The caller goes on writing
+ * after this returns, so nothing below here may run as a separate task.
+ */
+static void greeble_nested_area(struct greeble_context *gc, int x1, int y1, int x2, int y2, int limit)
+{
+	struct greeble_context nested = *gc;
+
+	nested.pool = NULL;
+	greeble_area(&nested, x1, y1, x2, y2, limit);
+}
+
+/* Greebles an area in place of a rectangle, timing it when profiling */
+static void greeble_rectangle_area(struct greeble_context *gc, int x1, int y1, int x2, int y2, int limit)
+{
+	uint64_t start;
+	long pixels;
+
+	if (!gc->profile) {
+		greeble_nested_area(gc, x1, y1, x2, y2, limit);
+		return;
+	}
+	pixels = profile_pixels;
+	start = cycle_counter();
+	greeble_nested_area(gc, x1, y1, x2, y2, limit);
+	profile_add(gc->profile, PROFILE_NESTED_AREA, cycle_counter() - start,
+			profile_pixels - pixels);
+}
+
+/* Either fills the area with greebles or splits it in two with a groove and recurses */
+static void greeble_split_area(struct greeble_context *gc, int x1, int y1, int x2, int y2, int limit)
 {
 	int dx, dy, x, y, dir;
 
 	dx = abs(x2 - x1);
 	dy = abs(y2 - y1);
 	if (dx > dy) {
-		if (dx < limit || (dx < limit * 8 && (rand() % 5) == 0)) {
-			populate_greebles(heightmap, dim, x1, y1, x2, y2, limit);
+		if (dx < limit || (dx < limit * 8 && (greeble_rand(gc) % 5) == 0)) {
+			populate_greebles(gc, x1, y1, x2, y2, limit);
 			return;
 		}
 		x = min(x1, x2);
 		x += dx / 2;
-		x += rand() % (dx / 2) - (dx / 4);
+		x += greeble_rand(gc) % (dx / 2) - (dx / 4);
 		y = min(y1, y2);
 		y += dy / 2;
 		dir = 1;
-		add_groove(heightmap, dim, x, y, dy, dir, 1);
-		greeble_area(heightmap, dim, x1, y1, x, y2, limit);
-		greeble_area(heightmap, dim, x, y1, x2, y2, limit);
+		add_groove(gc, x, y, dy, dir, 1);
+		greeble_child_area(gc, x1, y1, x, y2, limit, x, dir);
+		greeble_child_area(gc, x, y1, x2, y2, limit, x, dir);
 	} else {
-		if (dy < limit || (dy < limit * 8 && (rand() % 5) == 0)) {
-			populate_greebles(heightmap, dim, x1, y1, x2, y2, limit);
+		if (dy < limit || (dy < limit * 8 && (greeble_rand(gc) % 5) == 0)) {
+			populate_greebles(gc, x1, y1, x2, y2, limit);
 			return;
 		}
 		x = min(x1, x2);
 		x += dx / 2;
 		y = min(y1, y2);
 		y += dy / 2;
-		y += rand() % (dy / 2) - (dy / 4);
+		y += greeble_rand(gc) % (dy / 2) - (dy / 4);
 		dir = 0;
-		add_groove(heightmap, dim, x, y, dx, dir, 1);
-		greeble_area(heightmap, dim, x1, y1, x2, y, limit);
-		greeble_area(heightmap, dim, x1, y, x2, y2, limit);
+		add_groove(gc, x, y, dx, dir, 1);
+		greeble_child_area(gc, x1, y1, x2, y, limit, y, dir);
+		greeble_child_area(gc, x1, y, x2, y2, limit, y, dir);
 	}
 }
 
-int main(int argc, char *argv[])
+static void greeble_area(struct greeble_context *gc, int x1, int y1, int x2, int y2, int limit)
 {
-	unsigned char *heightmap, *hmap_img, *normal_img;
-	union vec3 *normalmap;
-	struct timeval tv;
+	if (gc->stats)
+		count_add(&gc->stats->areas[min(gc->depth, STATS_MAX_DEPTH - 1)], 1);
+	gc->depth++;
+	greeble_split_area(gc, x1, y1, x2, y2, limit);
+	gc->depth--;
+}
+
+static int nthreads = 0; /* 0 means one per cpu */
+static int parallel_greebling = 0;
+static int filled_rings = 0;
+static int accumulate = 0;
+static int dim = DIM;
+static char *save_scene = NULL;
+static char *load_scene = NULL;
+static int have_seed = 0;
+static unsigned long long seed;
+static int size_given = 0;
+static int bench = 0;
+static int print_stats = 0;
+static int print_profile = 0;
+static int use_counters = 0;
+static char *trace_file = NULL;
+static char *bench_baseline = NULL;
+static const struct png_profile *png_profile = NULL; /* NULL for the default */
+static int rgba_heightmap = 0;
+static int rgb_normalmap = 0;
+static int texture = -1; /* a texture container, or -1 for PNGs */
+static int mipmaps = 0;
+
+static struct option long_options[] = {
+	{ "accumulate", no_argument, NULL, 'a' },
+	{ "bench", no_argument, NULL, 'B' },
+	{ "bench-baseline", required_argument, NULL, 'b' },
+	{ "counters", no_argument, NULL, 'c' },
+	{ "filled-rings", no_argument, NULL, 'f' },
+	{ "help", no_argument, NULL, 'h' },
+	{ "rgba-heightmap", no_argument, NULL, 'H' },
+	{ "trace", required_argument, NULL, 'j' },
+	{ "load-scene", required_argument, NULL, 'L' },
+	{ "mipmaps", no_argument, NULL, 'm' },
+	{ "rgb-normalmap", no_argument, NULL, 'N' },
+	{ "parallel-greebling", no_argument, NULL, 'p' },
+	{ "profile", no_argument, NULL, 'P' },
+	{ "png-profile", required_argument, NULL, 'z' },
+	{ "save-scene", required_argument, NULL, 'S' },
+	{ "seed", required_argument, NULL, 'r' },
+	{ "size", required_argument, NULL, 's' },
+	{ "stats", no_argument, NULL, 'T' },
+	{ "threads", required_argument, NULL, 't' },
+	{ "texture", required_argument, NULL, 'x' },
+	{ 0, 0, 0, 0 },
+};
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: groovygreebler [options]\n");
+	fprintf(stderr, "  -a, --accumulate: sum up heights in a difference array and clamp them to\n");
+	fprintf(stderr, "          0..255 once at the end, instead of clamping after every primitive.\n");
+	fprintf(stderr, "          Much faster with large panels, but where panels pile up past the\n");
+	fprintf(stderr, "          limits the heightmap comes out differently.\n");
+	fprintf(stderr, "  -B, --bench: instead of writing maps, time each stage of making them at\n");
+	fprintf(stderr, "          1k, 4k, 8k and 16k (or just --size) and print the results as JSON.\n");
+	fprintf(stderr, "          The seed is 1 unless given.\n");
+	fprintf(stderr, "  -b, --bench-baseline file: with --bench, compare against the JSON from an\n");
+	fprintf(stderr, "          earlier --bench run, and exit with status 2 if a stage got slower\n");
+	fprintf(stderr, "  -c, --counters: print cycles, instructions per cycle, and cache and branch\n");
+	fprintf(stderr, "          misses per pixel of each stage to stderr, from the cpu's hardware\n");
+	fprintf(stderr, "          performance counters (Linux perf events).  Not with --bench.\n");
+	fprintf(stderr, "  -f, --filled-rings: subdivide large circles into filled sectors with\n");
+	fprintf(stderr, "          concentric bands instead of outlined nested rings\n");
+	fprintf(stderr, "  -h, --help: print this message\n");
+	fprintf(stderr, "  -H, --rgba-heightmap: write the heightmap as RGBA, gray in red, green and\n");
+	fprintf(stderr, "          blue, instead of 8-bit gray.  Textures are always BC4.\n");
+	fprintf(stderr, "  -j, --trace file: write a timeline of the stages and of the work each\n");
+	fprintf(stderr, "          thread did to file, in Chrome trace event format\n");
+	fprintf(stderr, "  -L, --load-scene file: instead of greebling, draw the scene saved in file\n");
+	fprintf(stderr, "          by --save-scene.  The scene is scaled to the size given by --size.\n");
+	fprintf(stderr, "  -m, --mipmaps: add every smaller mip level down to 1x1 to the textures,\n");
+	fprintf(stderr, "          only with --texture\n");
+	fprintf(stderr, "  -N, --rgb-normalmap: write the normal map as RGB instead of RGBA\n");
+	fprintf(stderr, "  -p, --parallel-greebling: greeble with a random number stream per subtree,\n");
+	fprintf(stderr, "          running large subtrees in parallel.  The result doesn't depend on\n");
+	fprintf(stderr, "          the number of threads, but differs from the default serial greebling.\n");
+	fprintf(stderr, "  -P, --profile: print the time and pixel updates that go into each kind of\n");
+	fprintf(stderr, "          primitive, subdividing circles and greebling inside rectangles to\n");
+	fprintf(stderr, "          stderr, in total and percentiles of the cost of each one\n");
+	fprintf(stderr, "  -r, --seed n: seed for the random number generator, the same seed and\n");
+	fprintf(stderr, "          options always give the same maps.  Default is to pick one.\n");
+	fprintf(stderr, "  -S, --save-scene file: save the primitives greebling decided on to file\n");
+	fprintf(stderr, "  -s, --size n: make n x n pixel maps, default is %d\n", DIM);
+	fprintf(stderr, "  -T, --stats: print the time and peak memory of each stage, how deep\n");
+	fprintf(stderr, "          greebling recursed, and counts of primitives, pixel updates and\n");
+	fprintf(stderr, "          clamped heights to stderr\n");
+	fprintf(stderr, "  -t, --threads n: number of worker threads, default is one per cpu\n");
+	fprintf(stderr, "  -x, --texture dds|ktx2: instead of PNGs, write heightmap.dds and\n");
+	fprintf(stderr, "          normalmap.dds (or .ktx2), block compressed, BC4 for the heights\n");
+	fprintf(stderr, "          and BC5 for the x and y of the normals\n");
+	fprintf(stderr, "  -z, --png-profile name: how hard to compress the PNGs, one of %s.\n",
+		png_parallel_profile_names());
+	fprintf(stderr, "          Default is balanced.\n");
+	exit(1);
+}
+
+static void process_options(int argc, char *argv[])
+{
+	int c, rc;
+
+	while (1) {
+		int option_index;
+
+		c = getopt_long(argc, argv, "aBb:cfHhj:L:mNPpr:S:s:Tt:x:z:", long_options, &option_index);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'a':
+			accumulate = 1;
+			break;
+		case 'B':
+			bench = 1;
+			break;
+		case 'b':
+			bench_baseline = optarg;
+			break;
+		case 'c':
+			use_counters = 1;
+			break;
+		case 'f':
+			filled_rings = 1;
+			break;
+		case 'H':
+			rgba_heightmap = 1;
+			break;
+		case 'L':
+			load_scene = optarg;
+			break;
+		case 'm':
+			mipmaps = 1;
+			break;
+		case 'N':
+			rgb_normalmap = 1;
+			break;
+		case 'P':
+			print_profile = 1;
+			break;
+		case 'p':
+			parallel_greebling = 1;
+			break;
+		case 'r':
+			rc = sscanf(optarg, "%llu", &seed);
+			if (rc != 1)
+				usage();
+			have_seed = 1;
+			break;
+		case 'S':
+			save_scene = optarg;
+			break;
+		case 's':
+			rc = sscanf(optarg, "%d", &dim);
+			if (rc != 1 || dim < 8 || dim > 32768)
+				usage();
+			size_given = 1;
+			break;
+		case 'j':
+			trace_file = optarg;
+			break;
+		case 'T':
+			print_stats = 1;
+			break;
+		case 't':
+			rc = sscanf(optarg, "%d", &nthreads);
+			if (rc != 1 || nthreads < 0)
+				usage();
+			break;
+		case 'x':
+			texture = texture_container(optarg);
+			if (texture < 0)
+				usage();
+			break;
+		case 'z':
+			png_profile = png_parallel_profile(optarg);
+			if (!png_profile)
+				usage();
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+	if ((mipmaps && texture < 0) || (use_counters && bench))
+		usage();
+}
+
+/* Stages of the current run are logged and counted here when these aren't NULL */
+static struct stage_log *stages;
+static struct greeble_stats *stats;
+static struct greeble_profile *profile;
+
+/* With --counters, hardware counter readings at the beginning and end of each stage */
+static struct perf_counters *counters;
+static struct perf_sample counters_at_begin[MAX_STAGES], counters_at_end[MAX_STAGES];
+
+static void begin_stage(const char *name)
+{
+	stage_begin(stages, name);
+	trace_begin("stage", name, NULL, 0);
+	if (counters && stages && stages->nstages < MAX_STAGES)
+		perf_counters_read(counters, &counters_at_begin[stages->nstages]);
+}
 
-	gettimeofday(&tv, NULL);
-	srand(tv.tv_usec);
+static void end_stage(const char *name)
+{
+	if (counters && stages && stages->nstages < MAX_STAGES)
+		perf_counters_read(counters, &counters_at_end[stages->nstages]);
+	trace_end("stage", name);
+	stage_end(stages);
+}
+
+/*
+ * Makes a dim x dim heightmap and normal map according to the options and
+ * writes them to the given files.  Returns 0 on success.
+ */
+static int make_maps(struct threadpool *pool, int dim, const char *heightmap_file,
+			const char *normalmap_file)
+{
+	unsigned char *heightmap, *hmap_img = NULL, *normal_img;
+	struct greeble_context gc;
+	struct display_list scene;
+	struct rng rng;
+	int record, rc = -1;
+	int normal_channels = rgb_normalmap ? 3 : 4;
+	int paint_rgba_heightmap = rgba_heightmap && texture < 0;
+
+	rng_init(&rng, seed);
+
+	/* A gray heightmap is written straight from the heights */
+	heightmap = allocate_heightmap(dim);
+	if (paint_rgba_heightmap)
+		hmap_img = allocate_output_image(dim, 4);
+	normal_img = allocate_output_image(dim, normal_channels);
+	if (!heightmap || (paint_rgba_heightmap && !hmap_img) || !normal_img) {
+		fprintf(stderr, "Out of memory allocating %dx%d maps\n", dim, dim);
+		goto out;
+	}
+
+	begin_stage("greeble");
+	initialize_heightmap(heightmap, dim, dim);
+
+	init_greeble_context(&gc, heightmap, dim);
+	gc.rng = &rng;
+	gc.filled_rings = filled_rings;
+	gc.stats = stats;
+	gc.profile = profile;
+	if (accumulate) {
+		gc.accum = calloc((size_t) dim * dim, sizeof(*gc.accum));
+		if (!gc.accum) {
+			fprintf(stderr, "Out of memory allocating accumulation buffer\n");
+			goto out;
+		}
+	}
+	if (load_scene) {
+		if (display_list_load(&scene, load_scene, dim)) {
+			fprintf(stderr, "Failed to load scene %s: %s\n", load_scene, strerror(errno));
+			free(gc.accum);
+			goto out;
+		}
+		rasterize_display_list_tiled(pool, &gc, &scene);
+		display_list_free(&scene);
+		goto paint;
+	}
 
-	heightmap = allocate_heightmap(DIM);
-	normalmap = allocate_normalmap(DIM);
-	hmap_img = allocate_output_image(DIM);
-	normal_img = allocate_output_image(DIM);
+	if (parallel_greebling) {
+		gc.subtree_streams = 1;
+		gc.pool = pool;
+	}
+	/*
+	 * Serial greebling spends most of its time drawing, so with more than one
+	 * thread, record the scene and draw it in tiles in parallel afterwards.
+	 */
+	record = save_scene || (!parallel_greebling && threadpool_nthreads(pool) > 1);
+	if (record) {
+		/* Recording is cheap, and a single list has to be filled in order */
+		display_list_init(&scene, dim);
+		gc.scene = &scene;
+		gc.pool = NULL;
+		if (profile)
+			profile->recorded = 1;
+	}
 
-	initialize_heightmap(heightmap, DIM, DIM);
+	//add_random_grooves(&gc, 100);
+	// add_random_rectangles(&gc, 20);
+	// add_random_circles(&gc, 0);
+	//add_random_rows(&gc, 150, 32);
 
-	//add_random_grooves(heightmap, DIM, 100);
-	// add_random_rectangles(heightmap, DIM, 20);
-	// add_random_circles(heightmap, DIM, 0);
-	//add_random_rows(heightmap, DIM, 150, 32);
+	greeble_area(&gc, 0, 0, dim - 1 , dim - 1, LIMIT);
+	threadpool_wait(pool);
 
-	greeble_area(heightmap, DIM, 0, 0, DIM - 1 , DIM - 1, LIMIT);
+	if (record) {
+		if (save_scene && display_list_save(&scene, save_scene))
+			fprintf(stderr, "Failed to save scene %s: %s\n", save_scene, strerror(errno));
+		gc.scene = NULL;
+		rasterize_display_list_tiled(pool, &gc, &scene);
+		display_list_free(&scene);
+	}
 
-	calculate_normalmap(heightmap, normalmap, DIM);
+paint:
+	if (gc.accum) {
+		materialize_accumulation(pool, &gc);
+		free(gc.accum);
+	}
+	end_stage("greeble");
 
-	paint_height_map(hmap_img, heightmap, DIM, 0, 255);
-	paint_normal_map(normal_img, normalmap, DIM);
+	if (paint_rgba_heightmap) {
+		begin_stage("paint_height_map");
+		paint_height_map(hmap_img, heightmap, dim, 0, 255);
+		end_stage("paint_height_map");
+	}
 
-	write_image("heightmap.png", hmap_img, DIM);
-	write_image("normalmap.png", normal_img, DIM);
+	/* Computing the normals and painting them is one pass */
+	begin_stage("paint_normal_map");
+	paint_normal_map(pool, normal_img, heightmap, dim, normal_channels);
+	end_stage("paint_normal_map");
+
+	if (texture >= 0) {
+		/* Straight from the heights and the normals' x and y */
+		begin_stage("texture_encode");
+		write_texture(pool, texture, mipmaps, heightmap_file, heightmap, dim, 1, 1);
+		write_texture(pool, texture, mipmaps, normalmap_file, normal_img, dim, normal_channels, 2);
+		end_stage("texture_encode");
+	} else {
+		begin_stage("png_encode");
+		if (rgba_heightmap)
+			write_image(pool, png_profile, heightmap_file, hmap_img, dim, 4);
+		else
+			write_image(pool, png_profile, heightmap_file, heightmap, dim, 1);
+		write_image(pool, png_profile, normalmap_file, normal_img, dim, normal_channels);
+		end_stage("png_encode");
+	}
+	rc = 0;
 
+out:
 	free(normal_img);
 	free(hmap_img);
-	free(normalmap);
 	free(heightmap);
-	return 0;
+	return rc;
+}
+
+/*
+ * --bench runs make_maps() at each size, writing the images to /dev/null,
+ * and prints the time each stage took as JSON, one result per line:
+ *
+ *   { "size": 4096, "stage": "greeble", "seconds": 1.234567, "mpixels_per_second": 13.59,
+ *     "peak_rss_kb": 123456 }
+ *
+ * (on one line).  The stage "total" covers the whole run.  Given the output
+ * of an earlier run with --bench-baseline, every result also gets the
+ * baseline's time, and is flagged as a regression if it is more than
+ * BENCH_REGRESSION_PERCENT slower.
+ */
+#define BENCH_REGRESSION_PERCENT 10
+#define BENCH_MIN_DIFFERENCE 0.005 /* seconds, anything less is noise */
+#define BENCH_MAX_RESULTS 256
+
+struct bench_result {
+	int size;
+	char stage[64];
+	double seconds;
+};
+
+static const int bench_sizes[] = { 1024, 4096, 8192, 16384 };
+
+static int load_bench_baseline(const char *filename, struct bench_result *r, int max)
+{
+	char line[512];
+	int n = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f)
+		return -1;
+	while (n < max && fgets(line, sizeof(line), f))
+		if (sscanf(line, " { \"size\": %d, \"stage\": \"%63[^\"]\", \"seconds\": %lf",
+				&r[n].size, r[n].stage, &r[n].seconds) == 3)
+			n++;
+	fclose(f);
+	return n;
+}
+
+static struct bench_result *find_bench_result(struct bench_result *r, int n, int size, const char *stage)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (r[i].size == size && strcmp(r[i].stage, stage) == 0)
+			return &r[i];
+	return NULL;
+}
+
+static int print_bench_result(int size, struct stage *st, struct bench_result *baseline, int nbaseline,
+				int first)
+{
+	struct bench_result *b;
+	int regression = 0;
+
+	printf("%s    { \"size\": %d, \"stage\": \"%s\", \"seconds\": %.6f, "
+		"\"mpixels_per_second\": %.2f, \"peak_rss_kb\": %ld",
+		first ? "" : ",\n", size, st->name, st->seconds,
+		st->seconds > 0.0 ? (double) size * size / st->seconds / 1e6 : 0.0, st->peak_rss_kb);
+	b = find_bench_result(baseline, nbaseline, size, st->name);
+	if (b) {
+		regression = st->seconds > b->seconds * (100 + BENCH_REGRESSION_PERCENT) / 100.0 &&
+				st->seconds - b->seconds > BENCH_MIN_DIFFERENCE;
+		printf(", \"baseline_seconds\": %.6f, \"regression\": %s",
+			b->seconds, regression ? "true" : "false");
+		if (regression)
+			fprintf(stderr, "Regression: %s at %d: %.3fs, baseline %.3fs\n",
+				st->name, size, st->seconds, b->seconds);
+	}
+	printf(" }");
+	return regression;
+}
+
+/* Returns 0 if all went well, 2 if anything regressed */
+static int run_benchmark(struct threadpool *pool)
+{
+	static struct bench_result baseline[BENCH_MAX_RESULTS];
+	struct stage_log log;
+	struct stage total;
+	int i, j, nbaseline = 0, first = 1, regressions = 0, nsizes, size;
+
+	if (bench_baseline) {
+		nbaseline = load_bench_baseline(bench_baseline, baseline, BENCH_MAX_RESULTS);
+		if (nbaseline < 0) {
+			fprintf(stderr, "Failed to read baseline %s: %s\n", bench_baseline, strerror(errno));
+			return 1;
+		}
+	}
+	nsizes = size_given ? 1 : (int) (sizeof(bench_sizes) / sizeof(bench_sizes[0]));
+	printf("{\n  \"threads\": %d,\n  \"seed\": %llu,\n  \"results\": [\n",
+		threadpool_nthreads(pool), seed);
+	for (i = 0; i < nsizes; i++) {
+		size = size_given ? dim : bench_sizes[i];
+		stage_log_init(&log);
+		stages = &log;
+		total.name = "total";
+		total.start = wall_time();
+		if (make_maps(pool, size, "/dev/null", "/dev/null")) {
+			/* Leave valid JSON with the sizes that did finish */
+			stages = NULL;
+			printf("\n  ]\n}\n");
+			return 1;
+		}
+		total.seconds = wall_time() - total.start;
+		total.peak_rss_kb = peak_rss_kb();
+		stages = NULL;
+		for (j = 0; j < log.nstages; j++) {
+			/* Every stage reset the high water mark */
+			if (log.stage[j].peak_rss_kb > total.peak_rss_kb)
+				total.peak_rss_kb = log.stage[j].peak_rss_kb;
+			regressions += print_bench_result(size, &log.stage[j], baseline, nbaseline, first);
+			first = 0;
+		}
+		regressions += print_bench_result(size, &total, baseline, nbaseline, first);
+		fflush(stdout);
+	}
+	printf("\n  ]\n}\n");
+	return regressions ? 2 : 0;
+}
+
+/* Counters that weren't available come out negative */
+static void print_count(double v, int width, int decimals)
+{
+	if (v < 0)
+		fprintf(stderr, " %*s", width, "n/a");
+	else
+		fprintf(stderr, " %*.*f", width, decimals, v);
+}
+
+static void report_counters(struct stage_log *log, int dim)
+{
+	double v[PERF_NCOUNTERS], pixels = (double) dim * dim;
+	int i, c;
+
+	fprintf(stderr, "%dx%d, hardware counters (user space, all threads):\n", dim, dim);
+	fprintf(stderr, "  %-20s %14s %14s %6s %12s %12s %12s\n", "stage", "cycles", "instructions",
+		"IPC", "L1D miss/px", "LLC miss/px", "br miss/px");
+	for (i = 0; i < log->nstages; i++) {
+		for (c = 0; c < PERF_NCOUNTERS; c++)
+			v[c] = perf_counter_delta(counters, c, &counters_at_begin[i], &counters_at_end[i]);
+		fprintf(stderr, "  %-20s", log->stage[i].name);
+		print_count(v[PERF_CYCLES], 14, 0);
+		print_count(v[PERF_INSTRUCTIONS], 14, 0);
+		print_count(v[PERF_CYCLES] > 0 && v[PERF_INSTRUCTIONS] >= 0 ?
+				v[PERF_INSTRUCTIONS] / v[PERF_CYCLES] : -1.0, 6, 2);
+		for (c = PERF_L1D_MISSES; c <= PERF_BRANCH_MISSES; c++)
+			print_count(v[c] >= 0 ? v[c] / pixels : -1.0, 12, 4);
+		fprintf(stderr, "\n");
+	}
+}
+
+static void report_stats(struct stage_log *log, struct greeble_stats *st, int dim)
+{
+	static const char *type_name[NPRIMITIVE_TYPES] = {
+		"grooves", "rectangles", "circles", "annulus sectors", "filled annulus sectors",
+	};
+	long peak = -1, total;
+	int i, deepest;
+
+	fprintf(stderr, "%dx%d, seed %llu\n", dim, dim, seed);
+	fprintf(stderr, "  %-20s %10s %12s %14s\n", "stage", "seconds", "Mpixels/s", "peak RSS kB");
+	for (i = 0; i < log->nstages; i++) {
+		fprintf(stderr, "  %-20s %10.3f %12.2f %14ld\n", log->stage[i].name,
+			log->stage[i].seconds, log->stage[i].seconds > 0.0 ?
+				(double) dim * dim / log->stage[i].seconds / 1e6 : 0.0,
+			log->stage[i].peak_rss_kb);
+		peak = max(peak, log->stage[i].peak_rss_kb);
+	}
+	fprintf(stderr, "  peak RSS: %ld kB\n", peak);
+
+	fprintf(stderr, "  greeble_area() calls by recursion depth:\n");
+	for (deepest = STATS_MAX_DEPTH - 1; deepest > 0 && !st->areas[deepest]; deepest--)
+		;
+	for (i = 0; i <= deepest; i++)
+		fprintf(stderr, "    %2d%s %10ld\n", i, i == STATS_MAX_DEPTH - 1 ? "+" : " ", st->areas[i]);
+
+	fprintf(stderr, "  primitives:\n");
+	for (i = 0, total = 0; i < NPRIMITIVE_TYPES; i++) {
+		fprintf(stderr, "    %-24s %10ld\n", type_name[i], st->primitives[i]);
+		total += st->primitives[i];
+	}
+	fprintf(stderr, "    %-24s %10ld\n", "total", total);
+	fprintf(stderr, "  spans drawn: %ld\n", st->spans);
+	fprintf(stderr, "  pixel updates: %ld (%.2f per pixel)\n", st->pixels,
+		(double) st->pixels / ((double) dim * dim));
+	fprintf(stderr, "  clamped at 0: %ld, at 255: %ld\n", st->clamped_low, st->clamped_high);
+}
+
+static void report_profile(struct stage_log *log, struct greeble_profile *prof, int dim)
+{
+	static const char *kind_name[PROFILE_NKINDS] = {
+		"groove", "rectangle", "circle", "annulus sector", "filled annulus sector",
+		"subdivide_circle()", "area in rectangle",
+	};
+	static const double q[] = { 0.5, 0.9, 0.99 };
+	struct profile_entry *e;
+	double total = 0.0;
+	int i, j;
+
+	for (i = 0; i < NPRIMITIVE_TYPES; i++)
+		total += prof->kind[i].cost;
+	fprintf(stderr, "%dx%d, seed %llu, greeble stage %.3f s, cost in %s\n", dim, dim, seed,
+		log->nstages > 0 ? log->stage[0].seconds : 0.0, cycle_counter_unit());
+	fprintf(stderr, "  %-22s %10s %14s %6s %12s %8s %10s %10s %10s %10s\n", "drawn", "count",
+		"cost", "%", "pixels", "cost/px", "p50", "p90", "p99", "max");
+	for (i = 0; i < PROFILE_NKINDS; i++) {
+		e = &prof->kind[i];
+		if (i == NPRIMITIVE_TYPES)
+			fprintf(stderr, "  from start to finish, including the primitives above that they emit%s:\n",
+				prof->recorded ? "\n  (but not drawing them, the scene was recorded and drawn later)" : "");
+		fprintf(stderr, "  %-22s %10ld %14ld", kind_name[i], e->count, e->cost);
+		if (i < NPRIMITIVE_TYPES)
+			fprintf(stderr, " %6.1f", total > 0.0 ? 100.0 * e->cost / total : 0.0);
+		else
+			fprintf(stderr, " %6s", "");
+		fprintf(stderr, " %12ld %8.1f", e->pixels, e->pixels ? (double) e->cost / e->pixels : 0.0);
+		for (j = 0; j < (int) (sizeof(q) / sizeof(q[0])); j++)
+			fprintf(stderr, " %10llu", (unsigned long long) profile_percentile(e, q[j]));
+		fprintf(stderr, " %10ld\n", e->max);
+	}
+	if (prof->recorded)
+		fprintf(stderr, "  primitives were drawn by tile, one count for each tile they touch\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct threadpool *pool;
+	struct stage_log log;
+	struct timeval tv;
+	int rc;
+
+	process_options(argc, argv);
+
+	/* Before any threads start, so that they are counted too */
+	if (use_counters) {
+		counters = perf_counters_open();
+		if (!counters)
+			fprintf(stderr, "Hardware counters not available: %s\n", strerror(errno));
+	}
+
+	pool = threadpool_create(nthreads);
+	if (!pool) {
+		fprintf(stderr, "Failed to create thread pool\n");
+		return 1;
+	}
+
+	if (trace_file && trace_open(trace_file)) {
+		fprintf(stderr, "Failed to start trace: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (bench) {
+		/* Benchmarks have to be repeatable */
+		if (!have_seed)
+			seed = 1;
+		rc = run_benchmark(pool);
+	} else {
+		if (!have_seed) {
+			gettimeofday(&tv, NULL);
+			seed = (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+		}
+		if (print_stats) {
+			stats = calloc(1, sizeof(*stats));
+			if (!stats) {
+				fprintf(stderr, "Out of memory\n");
+				return 1;
+			}
+		}
+		if (print_profile) {
+			profile = calloc(1, sizeof(*profile));
+			if (!profile) {
+				fprintf(stderr, "Out of memory\n");
+				return 1;
+			}
+		}
+		if (print_stats || print_profile || counters) {
+			stage_log_init(&log);
+			stages = &log;
+		}
+		if (texture >= 0) {
+			char heightmap_file[32], normalmap_file[32];
+
+			snprintf(heightmap_file, sizeof(heightmap_file), "heightmap.%s", texture_extension(texture));
+			snprintf(normalmap_file, sizeof(normalmap_file), "normalmap.%s", texture_extension(texture));
+			rc = make_maps(pool, dim, heightmap_file, normalmap_file) ? 1 : 0;
+		} else {
+			rc = make_maps(pool, dim, "heightmap.png", "normalmap.png") ? 1 : 0;
+		}
+		if (print_stats && rc == 0)
+			report_stats(&log, stats, dim);
+		if (print_profile && rc == 0)
+			report_profile(&log, profile, dim);
+		if (counters && rc == 0)
+			report_counters(&log, dim);
+		free(stats);
+		free(profile);
+		perf_counters_close(counters);
+	}
+	if (trace_close()) {
+		fprintf(stderr, "Failed to write trace %s: %s\n", trace_file, strerror(errno));
+		rc = 1;
+	}
+	threadpool_destroy(pool);
+	return rc;
 }
@@ -0,0 +1,608 @@
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Microbenchmarks of the inner kernels of groovygreebler, each timed on its
+ * own in cycles per element.  Kernels doing the same work are variants of
+ * one group, and the first variant of a group is the reference the others
+ * are compared against, so a new vectorized or restructured kernel only has
+ * to be added to the kernels[] table next to the one it replaces.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+
+#include "bc.h"
+#include "bline.h"
+#include "mtwist.h" /* before mathutils.h, which uses struct mtwist_state */
+#include "mathutils.h"
+#include "png_utils.h"
+#include "png_parallel.h"
+#include "rng.h"
+#include "sobel.h"
+#include "span.h"
+#include "threadpool.h"
+#include "timing.h"
+
+#define MAP_DIM 1024
+#define SCATTER_POINTS (1 << 20)
+#define SHORT_LINES 100000
+#define SHORT_LINE_LENGTH 8
+#define LONG_LINES 1000
+#define RANDOM_DRAWS 10000000
+#define FILL_BLOCK 1024
+#define MAX_REPS 1000
+
+static unsigned char *heightmap; /* MAP_DIM x MAP_DIM */
+static unsigned char *image; /* MAP_DIM x MAP_DIM RGBA */
+static short *dzdx, *dzdy; /* one row each */
+static unsigned char *normals; /* one RGBA row */
+static unsigned char normal_byte[2 * SOBEL_MAX_GRADIENT + 1], normal_blue;
+static int *scatter_x, *scatter_y, *scatter_h;
+static int short_lines[SHORT_LINES][4];
+static int long_lines[LONG_LINES][4];
+static uint32_t *fill_buffer;
+static struct mtwist_state *mt;
+static struct rng rng;
+
+/* Results get added in here so the compiler can't throw the work away */
+static volatile uint32_t sink;
+
+static void setup(void)
+{
+	int i;
+
+	heightmap = malloc(MAP_DIM * MAP_DIM);
+	image = malloc(4 * MAP_DIM * MAP_DIM);
+	dzdx = malloc(sizeof(*dzdx) * MAP_DIM);
+	dzdy = malloc(sizeof(*dzdy) * MAP_DIM);
+	normals = malloc(4 * MAP_DIM);
+	scatter_x = malloc(sizeof(*scatter_x) * SCATTER_POINTS);
+	scatter_y = malloc(sizeof(*scatter_y) * SCATTER_POINTS);
+	scatter_h = malloc(sizeof(*scatter_h) * SCATTER_POINTS);
+	fill_buffer = malloc(sizeof(*fill_buffer) * FILL_BLOCK);
+	if (!heightmap || !image || !dzdx || !dzdy || !normals || !scatter_x ||
+		!scatter_y || !scatter_h || !fill_buffer) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	rng_init(&rng, 1);
+	mt = mtwist_init(1);
+	for (i = 0; i < MAP_DIM * MAP_DIM; i++)
+		heightmap[i] = rng_next(&rng) & 0xff;
+	for (i = 0; i < 4 * MAP_DIM * MAP_DIM; i++)
+		image[i] = heightmap[i / 4];
+	for (i = 0; i < SCATTER_POINTS; i++) {
+		scatter_x[i] = rng_next(&rng) % MAP_DIM;
+		scatter_y[i] = rng_next(&rng) % MAP_DIM;
+		scatter_h[i] = (int) (rng_next(&rng) % 41) - 20;
+	}
+	for (i = 0; i < SHORT_LINES; i++) {
+		short_lines[i][0] = rng_next(&rng) % (MAP_DIM - 2 * SHORT_LINE_LENGTH) + SHORT_LINE_LENGTH;
+		short_lines[i][1] = rng_next(&rng) % (MAP_DIM - 2 * SHORT_LINE_LENGTH) + SHORT_LINE_LENGTH;
+		short_lines[i][2] = short_lines[i][0] + (int) (rng_next(&rng) % (2 * SHORT_LINE_LENGTH + 1)) -
+						SHORT_LINE_LENGTH;
+		short_lines[i][3] = short_lines[i][1] + (int) (rng_next(&rng) % (2 * SHORT_LINE_LENGTH + 1)) -
+						SHORT_LINE_LENGTH;
+	}
+	for (i = 0; i < LONG_LINES; i++) {
+		long_lines[i][0] = rng_next(&rng) % MAP_DIM;
+		long_lines[i][1] = rng_next(&rng) % MAP_DIM;
+		long_lines[i][2] = rng_next(&rng) % MAP_DIM;
+		long_lines[i][3] = rng_next(&rng) % MAP_DIM;
+	}
+}
+
+/*
+ * set_height() as greebling used it before spans: one clipped, saturating
+ * add per pixel.
+ */
+static inline void set_height(unsigned char *h, int dim, int x, int y, int v)
+{
+	int n;
+
+	if (x < 0 || x >= dim || y < 0 || y >= dim)
+		return;
+	n = h[y * dim + x] + v;
+	if (n < 0)
+		n = 0;
+	if (n > 255)
+		n = 255;
+	h[y * dim + x] = n;
+}
+
+static long set_height_random(void)
+{
+	int i;
+
+	for (i = 0; i < SCATTER_POINTS; i++)
+		set_height(heightmap, MAP_DIM, scatter_x[i], scatter_y[i], scatter_h[i]);
+	return SCATTER_POINTS;
+}
+
+/* Alternately up and down, so the map doesn't saturate over the repetitions */
+static int sequential_height(int row)
+{
+	return (row & 1) ? -7 : 7;
+}
+
+static long set_height_sequential(void)
+{
+	int x, y;
+
+	for (y = 0; y < MAP_DIM; y++)
+		for (x = 0; x < MAP_DIM; x++)
+			set_height(heightmap, MAP_DIM, x, y, sequential_height(y));
+	return MAP_DIM * MAP_DIM;
+}
+
+static long span_add_sequential(void)
+{
+	int y;
+
+	for (y = 0; y < MAP_DIM; y++)
+		span_add_saturated(&heightmap[y * MAP_DIM], MAP_DIM, sequential_height(y));
+	return MAP_DIM * MAP_DIM;
+}
+
+/*
+ * calculate_normal() and normal_to_rgba() as they were before the Sobel pass
+ * was vectorized.  This is a frozen copy on purpose: it's the baseline the
+ * sobel_row() variants are measured against, and stays put when the real
+ * code changes.
+ */
+static void calculate_normal(unsigned char *hmap, int i, int j, int dim, unsigned char *rgba)
+{
+	int i1, i2, j1, j2, dx, dy;
+	float nx, ny;
+
+	i1 = i > 0 ? i - 1 : i;
+	i2 = i < dim - 1 ? i + 1 : i;
+	j1 = j > 0 ? j - 1 : j;
+	j2 = j < dim - 1 ? j + 1 : j;
+	dx = ((int) hmap[j1 * dim + i1] - (int) hmap[j1 * dim + i2]) +
+		3 * ((int) hmap[j * dim + i1] - (int) hmap[j * dim + i2]);
+	dy = -((int) hmap[j2 * dim + i1] - (int) hmap[j1 * dim + i1]) -
+		3 * ((int) hmap[j2 * dim + i] - (int) hmap[j1 * dim + i]);
+	nx = ((float) dx / 4.0) / 127.0f + 0.5;
+	ny = ((float) dy / 4.0) / 127.0f + 0.5;
+	rgba[0] = (char) (int) (nx * 255);
+	rgba[1] = (char) (int) (ny * 255);
+	rgba[2] = 255;
+	rgba[3] = 255;
+}
+
+static long normals_per_pixel(void)
+{
+	int i, j;
+
+	for (j = 1; j < MAP_DIM - 1; j++) {
+		for (i = 1; i < MAP_DIM - 1; i++)
+			calculate_normal(heightmap, i, j, MAP_DIM, &normals[4 * i]);
+		sink += normals[4];
+	}
+	return (long) (MAP_DIM - 2) * (MAP_DIM - 2);
+}
+
+/* The bytes calculate_normal() gives for each gradient, like init_normal_bytes() does */
+static void init_normal_bytes(void)
+{
+	float n;
+	int g;
+
+	for (g = -SOBEL_MAX_GRADIENT; g <= SOBEL_MAX_GRADIENT; g++) {
+		n = ((float) g / 4.0) / 127.0f + 0.5;
+		normal_byte[g + SOBEL_MAX_GRADIENT] = (char) (int) (n * 255);
+	}
+	normal_blue = 255;
+}
+
+/* Gradients and then RGBA through the lookup table, as paint_normal_map_band() does */
+static long sobel_rows(sobel_row_fn fn)
+{
+	int i, j;
+
+	for (j = 1; j < MAP_DIM - 1; j++) {
+		fn(&heightmap[(j - 1) * MAP_DIM], &heightmap[j * MAP_DIM],
+			&heightmap[(j + 1) * MAP_DIM], MAP_DIM, dzdx, dzdy);
+		for (i = 1; i < MAP_DIM - 1; i++) {
+			normals[4 * i + 0] = normal_byte[dzdx[i] + SOBEL_MAX_GRADIENT];
+			normals[4 * i + 1] = normal_byte[dzdy[i] + SOBEL_MAX_GRADIENT];
+			normals[4 * i + 2] = normal_blue;
+			normals[4 * i + 3] = 255;
+		}
+		sink += normals[4];
+	}
+	return (long) (MAP_DIM - 2) * (MAP_DIM - 2);
+}
+
+static long sobel_scalar(void)
+{
+	return sobel_rows(sobel_row_implementation("scalar"));
+}
+
+static long sobel_sse41(void)
+{
+	return sobel_rows(sobel_row_implementation("sse4.1"));
+}
+
+static long sobel_avx2(void)
+{
+	return sobel_rows(sobel_row_implementation("avx2"));
+}
+
+static int sse41_supported(void)
+{
+	return sobel_row_implementation("sse4.1") != NULL;
+}
+
+static int avx2_supported(void)
+{
+	return sobel_row_implementation("avx2") != NULL;
+}
+
+/* Lines raise the pixels they cover by one, the way grooves are drawn */
+static long pixels_drawn;
+
+static void plot_pixel(int x, int y, void *context)
+{
+	set_height(heightmap, MAP_DIM, x, y, 1);
+	pixels_drawn++;
+}
+
+static void plot_run(int x, int y, int len, int vertical, void *context)
+{
+	unsigned char *p = &heightmap[y * MAP_DIM + x];
+	int i;
+
+	if (vertical) {
+		for (i = 0; i < len; i++)
+			set_height(heightmap, MAP_DIM, x, y + i, 1);
+	} else {
+		span_add_saturated(p, len, 1);
+	}
+	pixels_drawn += len;
+}
+
+static long lines_bline(int (*lines)[4], int nlines)
+{
+	int i;
+
+	pixels_drawn = 0;
+	for (i = 0; i < nlines; i++)
+		bline(lines[i][0], lines[i][1], lines[i][2], lines[i][3], plot_pixel, NULL);
+	return pixels_drawn;
+}
+
+static long lines_bline_clipped(int (*lines)[4], int nlines)
+{
+	int i;
+
+	pixels_drawn = 0;
+	for (i = 0; i < nlines; i++)
+		bline_clipped(lines[i][0], lines[i][1], lines[i][2], lines[i][3],
+				0, 0, MAP_DIM, MAP_DIM, plot_run, NULL);
+	return pixels_drawn;
+}
+
+static long short_bline(void)
+{
+	return lines_bline(short_lines, SHORT_LINES);
+}
+
+static long short_bline_clipped(void)
+{
+	return lines_bline_clipped(short_lines, SHORT_LINES);
+}
+
+static long long_bline(void)
+{
+	return lines_bline(long_lines, LONG_LINES);
+}
+
+static long long_bline_clipped(void)
+{
+	return lines_bline_clipped(long_lines, LONG_LINES);
+}
+
+static long draw_snis_rand(void)
+{
+	uint32_t x = 0;
+	int i;
+
+	for (i = 0; i < RANDOM_DRAWS; i++)
+		x += snis_rand();
+	sink += x;
+	return RANDOM_DRAWS;
+}
+
+static long draw_mtwist_next(void)
+{
+	uint32_t x = 0;
+	int i;
+
+	for (i = 0; i < RANDOM_DRAWS; i++)
+		x += mtwist_next(mt);
+	sink += x;
+	return RANDOM_DRAWS;
+}
+
+static long draw_mtwist_fill(void)
+{
+	uint32_t x = 0;
+	int i, j;
+
+	for (i = 0; i < RANDOM_DRAWS; i += FILL_BLOCK) {
+		mtwist_fill_u32(mt, fill_buffer, FILL_BLOCK);
+		for (j = 0; j < FILL_BLOCK; j++)
+			x += fill_buffer[j];
+	}
+	sink += x;
+	return i;
+}
+
+static long draw_rng_next(void)
+{
+	uint32_t x = 0;
+	int i;
+
+	for (i = 0; i < RANDOM_DRAWS; i++)
+		x += rng_next(&rng);
+	sink += x;
+	return RANDOM_DRAWS;
+}
+
+static long draw_rand(void)
+{
+	uint32_t x = 0;
+	int i;
+
+	for (i = 0; i < RANDOM_DRAWS; i++)
+		x += rand();
+	sink += x;
+	return RANDOM_DRAWS;
+}
+
+static long png_rows(void)
+{
+	if (png_utils_write_png_image("/dev/null", image, MAP_DIM, MAP_DIM, 1, 0)) {
+		fprintf(stderr, "Failed to write png\n");
+		exit(1);
+	}
+	return MAP_DIM;
+}
+
+/* On one thread, so that it compares per row with the serial encoder */
+static long png_parallel_rows(const char *profile)
+{
+	static struct threadpool *pool;
+
+	if (!pool)
+		pool = threadpool_create(1);
+	if (!pool || png_parallel_write_image(pool, "/dev/null", png_parallel_profile(profile),
+						image, MAP_DIM, MAP_DIM, 4, 0)) {
+		fprintf(stderr, "Failed to write png\n");
+		exit(1);
+	}
+	return MAP_DIM;
+}
+
+static long png_fastest_rows(void)
+{
+	return png_parallel_rows("fastest");
+}
+
+static long png_balanced_rows(void)
+{
+	return png_parallel_rows("balanced");
+}
+
+static long png_smallest_rows(void)
+{
+	return png_parallel_rows("smallest");
+}
+
+/* Every 4x4 block of the heightmap, as the texture encoder gathers them */
+static long bc4_blocks(bc4_encode_fn fn)
+{
+	unsigned char values[16], block[BC4_BLOCK_BYTES];
+	int bx, by, i;
+
+	for (by = 0; by < MAP_DIM / 4; by++) {
+		for (bx = 0; bx < MAP_DIM / 4; bx++) {
+			for (i = 0; i < 16; i++)
+				values[i] = heightmap[(by * 4 + i / 4) * MAP_DIM + bx * 4 + i % 4];
+			fn(values, block);
+			sink += block[2];
+		}
+	}
+	return (long) (MAP_DIM / 4) * (MAP_DIM / 4);
+}
+
+static long bc4_scalar(void)
+{
+	return bc4_blocks(bc4_encode_implementation("scalar"));
+}
+
+static long bc4_sse41(void)
+{
+	return bc4_blocks(bc4_encode_implementation("sse4.1"));
+}
+
+static int bc4_sse41_supported(void)
+{
+	return bc4_encode_implementation("sse4.1") != NULL;
+}
+
+struct kernel {
+	const char *group; /* all variants of a group do the same work */
+	const char *variant; /* the first of a group is the reference */
+	const char *element;
+	long (*run)(void); /* does the work once, returns the number of elements */
+	int (*supported)(void); /* NULL if it runs everywhere */
+};
+
+static struct kernel kernels[] = {
+	{ "set_height random", "set_height", "pixel", set_height_random, NULL },
+	{ "set_height sequential", "set_height", "pixel", set_height_sequential, NULL },
+	{ "set_height sequential", "span_add_saturated", "pixel", span_add_sequential, NULL },
+	{ "normals", "calculate_normal", "pixel", normals_per_pixel, NULL },
+	{ "normals", "sobel_row scalar", "pixel", sobel_scalar, NULL },
+	{ "normals", "sobel_row sse4.1", "pixel", sobel_sse41, sse41_supported },
+	{ "normals", "sobel_row avx2", "pixel", sobel_avx2, avx2_supported },
+	{ "bline short", "bline", "pixel", short_bline, NULL },
+	{ "bline short", "bline_clipped", "pixel", short_bline_clipped, NULL },
+	{ "bline long", "bline", "pixel", long_bline, NULL },
+	{ "bline long", "bline_clipped", "pixel", long_bline_clipped, NULL },
+	{ "random", "snis_rand", "draw", draw_snis_rand, NULL },
+	{ "random", "mtwist_next", "draw", draw_mtwist_next, NULL },
+	{ "random", "mtwist_fill_u32", "draw", draw_mtwist_fill, NULL },
+	{ "random", "rng_next", "draw", draw_rng_next, NULL },
+	{ "random", "rand", "draw", draw_rand, NULL },
+	{ "png", "png_utils_write_png_image", "row", png_rows, NULL },
+	{ "png", "png_parallel fastest", "row", png_fastest_rows, NULL },
+	{ "png", "png_parallel balanced", "row", png_balanced_rows, NULL },
+	{ "png", "png_parallel smallest", "row", png_smallest_rows, NULL },
+	{ "bc4", "bc4_encode_block scalar", "block", bc4_scalar, NULL },
+	{ "bc4", "bc4_encode_block sse4.1", "block", bc4_sse41, bc4_sse41_supported },
+};
+
+#define NKERNELS ((int) (sizeof(kernels) / sizeof(kernels[0])))
+
+static int reps = 10;
+static int warmup = 2;
+static char *filter = NULL;
+
+static int compare_doubles(const void *a, const void *b)
+{
+	const double *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+/* Median ticks per element of reps runs, after warmup runs, min in *fastest */
+static double time_kernel(struct kernel *k, double *fastest)
+{
+	static double per_element[MAX_REPS];
+	uint64_t start;
+	long n;
+	int i;
+
+	for (i = 0; i < warmup; i++)
+		k->run();
+	for (i = 0; i < reps; i++) {
+		start = cycle_counter();
+		n = k->run();
+		per_element[i] = (double) (cycle_counter() - start) / n;
+	}
+	qsort(per_element, reps, sizeof(per_element[0]), compare_doubles);
+	*fastest = per_element[0];
+	return per_element[reps / 2];
+}
+
+static void run_kernels(void)
+{
+	double median, fastest, reference = 0.0;
+	const char *group = "";
+	struct kernel *k;
+	int i;
+
+	printf("%-22s %-26s %-6s %10s %10s %9s\n", "kernel", "variant", "per",
+		"min", "median", "speedup");
+	for (i = 0; i < NKERNELS; i++) {
+		k = &kernels[i];
+		if (filter && !strstr(k->group, filter) && !strstr(k->variant, filter))
+			continue;
+		if (k->supported && !k->supported()) {
+			printf("%-22s %-26s (not supported by this cpu)\n", k->group, k->variant);
+			continue;
+		}
+		median = time_kernel(k, &fastest);
+		if (strcmp(k->group, group) != 0) {
+			group = k->group;
+			reference = median;
+		}
+		printf("%-22s %-26s %-6s %10.2f %10.2f %8.2fx\n", k->group, k->variant,
+			k->element, fastest, median, reference / median);
+		fflush(stdout);
+	}
+	printf("(min and median %s per element over %d runs after %d warm up runs,\n"
+		" speedup of the median over the first variant of the group)\n",
+		cycle_counter_unit(), reps, warmup);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: groovygreebler-microbench [options]\n");
+	fprintf(stderr, "  -f, --filter string: only kernels whose group or variant contains string\n");
+	fprintf(stderr, "  -h, --help: print this message\n");
+	fprintf(stderr, "  -l, --list: list the kernels and exit\n");
+	fprintf(stderr, "  -r, --reps n: timed runs of each kernel, default %d\n", reps);
+	fprintf(stderr, "  -w, --warmup n: untimed runs before them, default %d\n", warmup);
+	exit(1);
+}
+
+static struct option long_options[] = {
+	{ "filter", required_argument, NULL, 'f' },
+	{ "help", no_argument, NULL, 'h' },
+	{ "list", no_argument, NULL, 'l' },
+	{ "reps", required_argument, NULL, 'r' },
+	{ "warmup", required_argument, NULL, 'w' },
+	{ 0, 0, 0, 0 },
+};
+
+int main(int argc, char *argv[])
+{
+	int c, i, option_index;
+
+	while (1) {
+		c = getopt_long(argc, argv, "f:hlr:w:", long_options, &option_index);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'f':
+			filter = optarg;
+			break;
+		case 'l':
+			for (i = 0; i < NKERNELS; i++)
+				printf("%-22s %s\n", kernels[i].group, kernels[i].variant);
+			return 0;
+		case 'r':
+			if (sscanf(optarg, "%d", &reps) != 1 || reps < 1 || reps > MAX_REPS)
+				usage();
+			break;
+		case 'w':
+			if (sscanf(optarg, "%d", &warmup) != 1 || warmup < 0)
+				usage();
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+	setup();
+	init_normal_bytes();
+	run_kernels();
+	return 0;
+}
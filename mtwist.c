@@ -23,11 +23,18 @@
 
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "mtwist.h"
 
+#define MT_N 624
+#define MT_M 397
+#define MT_MATRIX_A 0x9908b0dfU /* 2567483615 */
+
 struct mtwist_state {
-	uint32_t mt[624];
+	uint32_t mt[MT_N];
 	uint32_t index;
 };
 
@@ -44,7 +51,7 @@ struct mtwist_state *mtwist_init(uint32_t seed)
 
 	mtstate->index = 0;
 	mtstate->mt[0] = seed;
-	for (i = 1; i < 624; i++) {
+	for (i = 1; i < MT_N; i++) {
 		const uint64_t a = 1812433253ULL;
 		uint64_t b = (uint64_t) mtstate->mt[i - 1] >> 30;
 		uint64_t c = (a * (mtstate->mt[i - 1] ^ b) + i);
@@ -53,42 +60,180 @@ struct mtwist_state *mtwist_init(uint32_t seed)
 	return mtstate;
 }
 
-static void generate_numbers(struct mtwist_state *mtstate)
+/* One step of the recurrence, mt[i] from mt[i], mt[i + 1] and mt[i + 397], all mod 624 */
+static inline uint32_t twist(uint32_t cur, uint32_t next, uint32_t far)
 {
-	int i;
+	uint32_t y = (cur & 0x80000000) | (next & 0x7fffffff);
 
-	for (i = 0; i < 624; i++) {
-		uint32_t y = (mtstate->mt[i] & 0x80000000)
-				+ (mtstate->mt[(i + 1) % 624] & 0x7fffffff);
-		mtstate->mt[i] = mtstate->mt[(i + 397) % 624] ^ (y >> 1);
-		if (y % 2)
-			mtstate->mt[i] = mtstate->mt[i] ^ 2567483615;
-	}
+	return far ^ (y >> 1) ^ ((y & 1) ? MT_MATRIX_A : 0);
 }
 
-uint32_t mtwist_next(struct mtwist_state *mtstate)
+#ifdef __SSE2__
+/* Four steps at once, mt[i .. i + 3] from mt[i .. i + 4] and far[0 .. 3] */
+static inline void twist4(uint32_t *mt, int i, const uint32_t *far)
 {
-	if (mtstate->index == 0)
-		generate_numbers(mtstate);
+	const __m128i upper = _mm_set1_epi32((int) 0x80000000);
+	const __m128i lower = _mm_set1_epi32(0x7fffffff);
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128i matrix = _mm_set1_epi32((int) MT_MATRIX_A);
+	__m128i cur, next, y, r;
+
+	cur = _mm_loadu_si128((__m128i *) &mt[i]);
+	next = _mm_loadu_si128((__m128i *) &mt[i + 1]);
+	y = _mm_or_si128(_mm_and_si128(cur, upper), _mm_and_si128(next, lower));
+	r = _mm_xor_si128(_mm_loadu_si128((const __m128i *) far), _mm_srli_epi32(y, 1));
+	/* y odd: all ones & matrix, y even: 0 */
+	r = _mm_xor_si128(r, _mm_and_si128(_mm_cmpeq_epi32(_mm_and_si128(y, one), one), matrix));
+	_mm_storeu_si128((__m128i *) &mt[i], r);
+}
+#endif
+
+/*
+ * The loop over all 624 words is split where the indices i + 1 and i + 397
+ * wrap around, so there is no modulo left, and the first two parts are done
+ * four words at a time.  mt[i + 1 .. i + 4] are read before any of them is
+ * rewritten, and mt[i - 227 ..] were rewritten earlier in the same pass,
+ * exactly as in the one word at a time loop.
+ */
+static void generate_numbers(struct mtwist_state *mtstate)
+{
+	uint32_t *mt = mtstate->mt;
+	int i = 0;
+
+#ifdef __SSE2__
+	for (; i + 4 <= MT_N - MT_M; i += 4)
+		twist4(mt, i, &mt[i + MT_M]);
+#endif
+	for (; i < MT_N - MT_M; i++)
+		mt[i] = twist(mt[i], mt[i + 1], mt[i + MT_M]);
+#ifdef __SSE2__
+	for (; i + 4 <= MT_N - 1; i += 4)
+		twist4(mt, i, &mt[i + MT_M - MT_N]);
+#endif
+	for (; i < MT_N - 1; i++)
+		mt[i] = twist(mt[i], mt[i + 1], mt[i + MT_M - MT_N]);
+	mt[MT_N - 1] = twist(mt[MT_N - 1], mt[0], mt[MT_M - 1]);
+}
 
-	uint32_t y = mtstate->mt[mtstate->index];
+static inline uint32_t temper(uint32_t y)
+{
 	y = y ^ (y >> 11);
 	y = y ^ ((y << 7) & 2636928640);
 	y = y ^ ((y << 15) & 4022730752);
 	y = y ^ (y >> 18);
+	return y;
+}
+
+uint32_t mtwist_next(struct mtwist_state *mtstate)
+{
+	uint32_t y;
+
+	if (mtstate->index == 0)
+		generate_numbers(mtstate);
 
-	mtstate->index = (mtstate->index + 1) % 624;
+	y = temper(mtstate->mt[mtstate->index]);
+	if (++mtstate->index == MT_N)
+		mtstate->index = 0;
 	return y;
 }
 
+void mtwist_fill_u32(struct mtwist_state *mtstate, uint32_t *out, int n)
+{
+	int i, count;
+	uint32_t *mt;
+#ifdef __SSE2__
+	__m128i y;
+	const __m128i b = _mm_set1_epi32((int) 2636928640U);
+	const __m128i c = _mm_set1_epi32((int) 4022730752U);
+#endif
+
+	while (n > 0) {
+		if (mtstate->index == 0)
+			generate_numbers(mtstate);
+		/* As many as are left in this block of 624 */
+		count = MT_N - mtstate->index;
+		if (count > n)
+			count = n;
+		mt = &mtstate->mt[mtstate->index];
+		i = 0;
+#ifdef __SSE2__
+		for (; i + 4 <= count; i += 4) {
+			y = _mm_loadu_si128((__m128i *) &mt[i]);
+			y = _mm_xor_si128(y, _mm_srli_epi32(y, 11));
+			y = _mm_xor_si128(y, _mm_and_si128(_mm_slli_epi32(y, 7), b));
+			y = _mm_xor_si128(y, _mm_and_si128(_mm_slli_epi32(y, 15), c));
+			y = _mm_xor_si128(y, _mm_srli_epi32(y, 18));
+			_mm_storeu_si128((__m128i *) &out[i], y);
+		}
+#endif
+		for (; i < count; i++)
+			out[i] = temper(mt[i]);
+		out += count;
+		n -= count;
+		mtstate->index += count;
+		if (mtstate->index == MT_N)
+			mtstate->index = 0;
+	}
+}
+
+/*
+ * (float) 0xfffffffe rounds to exactly 2^32, so multiplying by 2^-32 gives
+ * the same results as the division mtwist_float() always did.
+ */
+#define MT_FLOAT_SCALE (1.0f / 4294967296.0f)
+
 float mtwist_float(struct mtwist_state *mtstate)
 {
-	return (float) mtwist_next(mtstate) / (float) 0xfffffffeUL;
+	return (float) mtwist_next(mtstate) * MT_FLOAT_SCALE;
+}
+
+void mtwist_fill_float(struct mtwist_state *mtstate, float *out, int n)
+{
+	uint32_t buf[MT_N];
+	int i, count;
+
+	while (n > 0) {
+		count = n < MT_N ? n : MT_N;
+		mtwist_fill_u32(mtstate, buf, count);
+		for (i = 0; i < count; i++)
+			out[i] = (float) buf[i] * MT_FLOAT_SCALE;
+		out += count;
+		n -= count;
+	}
+}
+
+/*
+ * Lemire's multiply and shift: the high 32 bits of x * n are uniform in
+ * 0 .. n - 1 once the few low products that would bias them are rejected.
+ */
+static inline uint32_t bounded(struct mtwist_state *mtstate, uint32_t x, uint32_t n)
+{
+	uint64_t m = (uint64_t) x * n;
+	uint32_t threshold;
+
+	if ((uint32_t) m < n) {
+		threshold = -n % n;
+		while ((uint32_t) m < threshold) {
+			x = mtwist_next(mtstate);
+			m = (uint64_t) x * n;
+		}
+	}
+	return (uint32_t) (m >> 32);
 }
 
 int mtwist_int(struct mtwist_state *mtstate, int n)
 {
-	return (int) (mtwist_next(mtstate) % n);
+	return (int) bounded(mtstate, mtwist_next(mtstate), n);
+}
+
+void mtwist_fill_int(struct mtwist_state *mtstate, int *out, int count, int n)
+{
+	int i;
+
+	/* Rejections are rare (< n / 2^32), so draw in bulk and top up as needed */
+	mtwist_fill_u32(mtstate, (uint32_t *) out, count);
+	for (i = 0; i < count; i++)
+		out[i] = (int) bounded(mtstate, (uint32_t) out[i], n);
 }
 
 void mtwist_free(struct mtwist_state *mt)
@@ -96,4 +241,3 @@ void mtwist_free(struct mtwist_state *mt)
 	if (mt)
 		free(mt);
 }
-
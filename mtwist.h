@@ -29,9 +29,19 @@ struct mtwist_state;
 
 struct mtwist_state *mtwist_init(uint32_t seed);
 uint32_t mtwist_next(struct mtwist_state *mtstate);
-float mtwist_float(struct mtwist_state *mtstate);
-int mtwist_int(struct mtwist_state *mtstate, int n);
+float mtwist_float(struct mtwist_state *mtstate); /* 0.0 .. 1.0 */
+int mtwist_int(struct mtwist_state *mtstate, int n); /* 0 .. n - 1, n > 0, unbiased */
 void mtwist_free(struct mtwist_state *mt);
 
+/*
+ * Bulk versions that fill arrays without a call per number.  mtwist_fill_u32()
+ * and mtwist_fill_float() give exactly what as many calls of mtwist_next() and
+ * mtwist_float() would.  mtwist_fill_int() gives 0 .. n - 1 just as uniformly
+ * as mtwist_int(), but on the rare rejected draw not in the same order.
+ */
+void mtwist_fill_u32(struct mtwist_state *mtstate, uint32_t *out, int count);
+void mtwist_fill_float(struct mtwist_state *mtstate, float *out, int count);
+void mtwist_fill_int(struct mtwist_state *mtstate, int *out, int count, int n);
+
 #endif
 
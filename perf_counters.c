@@ -0,0 +1,131 @@
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf_counters.h"
+
+struct perf_counters {
+	int fd[PERF_NCOUNTERS]; /* -1 where not available */
+};
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} counter[PERF_NCOUNTERS] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "L1D misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ "LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int open_counter(int c)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = counter[c].type;
+	attr.config = counter[c].config;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	/* This process, any cpu */
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+struct perf_counters *perf_counters_open(void)
+{
+	struct perf_counters *pc;
+	int c, n = 0, err = 0;
+
+	pc = malloc(sizeof(*pc));
+	if (!pc)
+		return NULL;
+	for (c = 0; c < PERF_NCOUNTERS; c++) {
+		pc->fd[c] = open_counter(c);
+		if (pc->fd[c] >= 0)
+			n++;
+		else
+			err = errno;
+	}
+	if (!n) {
+		free(pc);
+		errno = err;
+		return NULL;
+	}
+	return pc;
+}
+
+void perf_counters_read(struct perf_counters *pc, struct perf_sample *s)
+{
+	uint64_t v[3];
+	int c;
+
+	memset(s, 0, sizeof(*s));
+	for (c = 0; c < PERF_NCOUNTERS; c++) {
+		if (pc->fd[c] < 0 || read(pc->fd[c], v, sizeof(v)) != sizeof(v))
+			continue;
+		s->value[c] = v[0];
+		s->enabled[c] = v[1];
+		s->running[c] = v[2];
+	}
+}
+
+double perf_counter_delta(struct perf_counters *pc, int c, struct perf_sample *start,
+				struct perf_sample *end)
+{
+	uint64_t running, enabled;
+
+	if (pc->fd[c] < 0)
+		return -1.0;
+	running = end->running[c] - start->running[c];
+	enabled = end->enabled[c] - start->enabled[c];
+	if (!running)
+		return enabled ? -1.0 : 0.0;
+	return (double) (end->value[c] - start->value[c]) * enabled / running;
+}
+
+const char *perf_counter_name(int c)
+{
+	return counter[c].name;
+}
+
+void perf_counters_close(struct perf_counters *pc)
+{
+	int c;
+
+	if (!pc)
+		return;
+	for (c = 0; c < PERF_NCOUNTERS; c++)
+		if (pc->fd[c] >= 0)
+			close(pc->fd[c]);
+	free(pc);
+}
@@ -0,0 +1,64 @@
+#ifndef PERF_COUNTERS_H__
+#define PERF_COUNTERS_H__
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdint.h>
+
+/*
+ * Hardware performance counters of the whole process, through Linux
+ * perf_event_open(2).  Only user space is counted, which works with the
+ * default perf_event_paranoid setting.  Counters are inherited by threads
+ * created after perf_counters_open(), so open them before starting any
+ * worker threads for the threads' work to be counted.
+ */
+enum perf_counter {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_L1D_MISSES, /* level 1 data cache read misses */
+	PERF_LLC_MISSES, /* last level cache misses */
+	PERF_BRANCH_MISSES,
+	PERF_NCOUNTERS,
+};
+
+struct perf_counters;
+
+struct perf_sample {
+	uint64_t value[PERF_NCOUNTERS];
+	/* When there are more counters than the hardware has, they take turns */
+	uint64_t enabled[PERF_NCOUNTERS], running[PERF_NCOUNTERS];
+};
+
+/* NULL if none of the counters can be opened, errno tells why */
+struct perf_counters *perf_counters_open(void);
+void perf_counters_read(struct perf_counters *pc, struct perf_sample *s);
+
+/*
+ * How much counter c went up from start to end, scaled up for any time it
+ * wasn't running, or -1 if this counter isn't available.
+ */
+double perf_counter_delta(struct perf_counters *pc, int c, struct perf_sample *start,
+				struct perf_sample *end);
+
+const char *perf_counter_name(int c);
+void perf_counters_close(struct perf_counters *pc);
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef PNG_PARALLEL_H__
+#define PNG_PARALLEL_H__
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * A PNG encoder that filters and deflates horizontal stripes of the image
+ * on separate threads, the way pigz does: every stripe is a raw deflate
+ * stream of its own, primed with the 32k of filtered rows before it and
+ * ended with a sync flush (the last one with a proper finish), so they
+ * simply concatenate into one zlib stream.  Their adler32s are combined
+ * with adler32_combine().  The result is a standard PNG.
+ *
+ * How hard it tries is up to a profile: which filter the rows get, and
+ * the zlib compression level and strategy.  A fixed filter skips trying
+ * all five on every row, and goes through loops specialized for gray
+ * and RGBA pixels.
+ */
+#include <stddef.h>
+
+struct threadpool;
+struct png_sink;
+
+#define PNG_ADAPTIVE_FILTER -1 /* each row gets the filter with the smallest sum of absolute differences */
+
+struct png_profile {
+	const char *name;
+	int filter; /* PNG filter type 0 .. 4 for every row, or PNG_ADAPTIVE_FILTER */
+	int level, strategy; /* for deflateInit2() */
+};
+
+/*
+ * "fastest", "balanced" or "smallest", or NULL if there is no such
+ * profile.  "balanced" is the default.
+ */
+const struct png_profile *png_parallel_profile(const char *name);
+
+/* Names of the profiles, separated by commas, for usage messages */
+const char *png_parallel_profile_names(void);
+
+/*
+ * Writes a w x h 8-bit image with 1 (gray), 3 (RGB) or 4 (RGBA) channels
+ * to sink, flipped upside down if invert is set.  profile may be NULL for
+ * the default.  Returns 0 on success, or -1 with errno set.
+ */
+int png_parallel_write_sink(struct threadpool *pool, struct png_sink *sink,
+		const struct png_profile *profile, const unsigned char *pixels,
+		int w, int h, int channels, int invert);
+
+/* The same, writing to filename */
+int png_parallel_write_image(struct threadpool *pool, const char *filename,
+		const struct png_profile *profile, const unsigned char *pixels,
+		int w, int h, int channels, int invert);
+
+#endif
@@ -20,76 +20,218 @@
 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <png.h>
 
-int png_utils_write_png_image(const char *filename, unsigned char *pixels, int w, int h, int has_alpha, int invert)
+#include "png_utils.h"
+
+static int fd_sink_write(void *cookie, const unsigned char *data, size_t n)
 {
+	struct png_sink *sink = cookie;
+	ssize_t rc;
+
+	while (n > 0) {
+		rc = write(sink->fd, data, n);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += rc;
+		n -= rc;
+	}
+	return 0;
+}
+
+void png_utils_fd_sink(struct png_sink *sink, int fd)
+{
+	memset(sink, 0, sizeof(*sink));
+	sink->write = fd_sink_write;
+	sink->cookie = sink;
+	sink->fd = fd;
+}
+
+static int memory_sink_write(void *cookie, const unsigned char *data, size_t n)
+{
+	struct png_sink *sink = cookie;
+	unsigned char *newdata;
+	size_t allocated;
+
+	if (sink->size + n > sink->allocated) {
+		allocated = sink->allocated ? sink->allocated : 65536;
+		while (allocated < sink->size + n)
+			allocated *= 2;
+		newdata = realloc(sink->data, allocated);
+		if (!newdata)
+			return -1;
+		sink->data = newdata;
+		sink->allocated = allocated;
+	}
+	memcpy(&sink->data[sink->size], data, n);
+	sink->size += n;
+	return 0;
+}
+
+void png_utils_memory_sink(struct png_sink *sink)
+{
+	memset(sink, 0, sizeof(*sink));
+	sink->write = memory_sink_write;
+	sink->cookie = sink;
+	sink->fd = -1;
+}
+
+void png_utils_callback_sink(struct png_sink *sink,
+		int (*write)(void *cookie, const unsigned char *data, size_t n), void *cookie)
+{
+	memset(sink, 0, sizeof(*sink));
+	sink->write = write;
+	sink->cookie = cookie;
+	sink->fd = -1;
+}
+
+struct png_writer {
 	png_structp png_ptr;
 	png_infop info_ptr;
-	png_byte **row;
-	int x, y, rc, colordepth = 8;
-	int bytes_per_pixel = has_alpha ? 4 : 3;
-	FILE *f;
-
-	rc = -1; /* assume failure until we eventually succeed */
-	f = fopen(filename, "w");
-	if (!f) {
-		fprintf(stderr, "fopen: %s:%s\n", filename, strerror(errno));
-		return -1;
+	struct png_sink *sink;
+	int h, rows_written;
+	int failed, error; /* error is the errno to fail with */
+};
+
+static void png_writer_write(png_structp png_ptr, png_bytep data, png_size_t n)
+{
+	struct png_writer *pw = png_get_io_ptr(png_ptr);
+
+	if (pw->sink->write(pw->sink->cookie, data, n)) {
+		pw->error = errno;
+		png_error(png_ptr, strerror(errno));
 	}
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png_ptr)
-		goto cleanup1;
-	info_ptr = png_create_info_struct(png_ptr);
-	if (!info_ptr)
-		goto cleanup2;
-	if (setjmp(png_jmpbuf(png_ptr))) /* oh libpng, you're old as dirt, aren't you. */
-		goto cleanup2;
+}
+
+static void png_writer_flush(png_structp png_ptr)
+{
+}
+
+/* Marks pw failed, with errno e unless the sink already gave one */
+static void png_writer_fail(struct png_writer *pw, int e)
+{
+	pw->failed = 1;
+	if (!pw->error)
+		pw->error = e;
+}
 
-	png_set_IHDR(png_ptr, info_ptr, (size_t) w, (size_t) h, colordepth,
+struct png_writer *png_utils_begin(struct png_sink *sink, int w, int h, int has_alpha)
+{
+	struct png_writer *pw;
+
+	pw = calloc(1, sizeof(*pw));
+	if (!pw)
+		return NULL;
+	pw->sink = sink;
+	pw->h = h;
+	pw->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!pw->png_ptr)
+		goto fail;
+	pw->info_ptr = png_create_info_struct(pw->png_ptr);
+	if (!pw->info_ptr)
+		goto fail;
+	if (setjmp(png_jmpbuf(pw->png_ptr))) /* oh libpng, you're old as dirt, aren't you. */
+		goto fail;
+
+	png_set_write_fn(pw->png_ptr, pw, png_writer_write, png_writer_flush);
+	png_set_IHDR(pw->png_ptr, pw->info_ptr, (size_t) w, (size_t) h, 8,
 			has_alpha ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB,
 			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
 			PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(pw->png_ptr, pw->info_ptr);
+	return pw;
+
+fail:
+	png_writer_fail(pw, ENOMEM);
+	png_destroy_write_struct(&pw->png_ptr, &pw->info_ptr);
+	errno = pw->error;
+	free(pw);
+	return NULL;
+}
 
-	row = png_malloc(png_ptr, h * sizeof(*row));
-	if (!invert) {
-		for (y = 0; y < h; y++) {
-			row[y] = png_malloc(png_ptr, w * bytes_per_pixel);
-			for (x = 0; x < w; x++) {
-				unsigned char *r = (unsigned char *) row[y];
-				unsigned char *src = (unsigned char *)
-					&pixels[y * w * bytes_per_pixel + x * bytes_per_pixel];
-				unsigned char *dest = &r[x * bytes_per_pixel];
-				memcpy(dest, src, bytes_per_pixel);
-			}
-		}
-	} else {
-		for (y = 0; y < h; y++) {
-			row[h - y - 1] = png_malloc(png_ptr, w * bytes_per_pixel);
-			for (x = 0; x < w; x++) {
-				unsigned char *r = (unsigned char *) row[h - y - 1];
-				unsigned char *src = (unsigned char *)
-					&pixels[y * w * bytes_per_pixel + x * bytes_per_pixel];
-				unsigned char *dest = &r[x * bytes_per_pixel];
-				memcpy(dest, src, bytes_per_pixel);
-			}
-		}
+int png_utils_write_rows(struct png_writer *pw, const unsigned char *rows, int nrows, ptrdiff_t stride)
+{
+	int i;
+
+	if (!pw || pw->failed)
+		return -1;
+	if (nrows < 0 || nrows > pw->h - pw->rows_written) {
+		png_writer_fail(pw, EINVAL);
+		return -1;
+	}
+	if (setjmp(png_jmpbuf(pw->png_ptr))) {
+		png_writer_fail(pw, EIO);
+		return -1;
+	}
+	for (i = 0; i < nrows; i++)
+		png_write_row(pw->png_ptr, rows + i * stride);
+	pw->rows_written += nrows;
+	return 0;
+}
+
+int png_utils_end(struct png_writer *pw)
+{
+	int rc, error;
+
+	if (!pw)
+		return -1;
+	if (!pw->failed && pw->rows_written < pw->h)
+		png_writer_fail(pw, EINVAL);
+	if (!pw->failed) {
+		if (setjmp(png_jmpbuf(pw->png_ptr)))
+			png_writer_fail(pw, EIO);
+		else
+			png_write_end(pw->png_ptr, NULL);
 	}
+	rc = pw->failed ? -1 : 0;
+	error = pw->error;
+	png_destroy_write_struct(&pw->png_ptr, &pw->info_ptr);
+	free(pw);
+	if (rc)
+		errno = error;
+	return rc;
+}
 
-	png_init_io(png_ptr, f);
-	png_set_rows(png_ptr, info_ptr, row);
-	png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_PACKING, NULL);
+int png_utils_write_png_sink(struct png_sink *sink, unsigned char *pixels, int w, int h,
+		int has_alpha, int invert)
+{
+	struct png_writer *pw;
+	ptrdiff_t stride = (ptrdiff_t) w * (has_alpha ? 4 : 3);
+
+	pw = png_utils_begin(sink, w, h, has_alpha);
+	if (invert)
+		png_utils_write_rows(pw, pixels + (h - 1) * stride, h, -stride);
+	else
+		png_utils_write_rows(pw, pixels, h, stride);
+	return png_utils_end(pw);
+}
+
+int png_utils_write_png_image(const char *filename, unsigned char *pixels, int w, int h, int has_alpha, int invert)
+{
+	struct png_sink sink;
+	int fd, rc, error;
 
-	for (y = 0; y < h; y++)
-		png_free(png_ptr, row[y]);
-	png_free(png_ptr, row);
-	rc = 0; /* success */
-cleanup2:
-	png_destroy_write_struct(&png_ptr, &info_ptr);
-cleanup1:
-	fclose(f);
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "open: %s:%s\n", filename, strerror(errno));
+		return -1;
+	}
+	png_utils_fd_sink(&sink, fd);
+	rc = png_utils_write_png_sink(&sink, pixels, w, h, has_alpha, invert);
+	error = errno;
+	if (close(fd) && !rc) {
+		error = errno;
+		rc = -1;
+	}
+	errno = error;
 	return rc;
 }
 
@@ -157,8 +299,10 @@ char *png_utils_read_png_image(const char *filename, int flipVertical, int flipH
 	 * PNG_TRANSFORM_STRIP_16 |
 	 * PNG_TRANSFORM_PACKING  forces 8 bit
 	 * PNG_TRANSFORM_EXPAND forces to expand a palette into RGB
+	 * PNG_TRANSFORM_GRAY_TO_RGB makes gray images RGB too
 	 */
-	png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND, NULL);
+	png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND |
+			PNG_TRANSFORM_GRAY_TO_RGB, NULL);
 
 	png_get_IHDR(png_ptr, info_ptr, &tw, &th, &bit_depth, &color_type, NULL, NULL, NULL);
 
@@ -20,8 +20,49 @@
 	along with Gaseous Giganticus; if not, write to the Free Software
 	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
+#include <stddef.h>
 #include <png.h>
 
+/*
+ * Where the PNG writer puts its output.  write() gets cookie and returns
+ * 0 on success, or sets errno and returns -1.  Set one up with one of the
+ * png_utils_*_sink() functions below.
+ */
+struct png_sink {
+	int (*write)(void *cookie, const unsigned char *data, size_t n);
+	void *cookie;
+	int fd; /* for png_utils_fd_sink() */
+	unsigned char *data; /* for png_utils_memory_sink(), free() it when done */
+	size_t size, allocated;
+};
+
+/* Writes to fd, which is left open */
+void png_utils_fd_sink(struct png_sink *sink, int fd);
+
+/* Collects the output in sink->data, sink->size bytes of it */
+void png_utils_memory_sink(struct png_sink *sink);
+
+/* Hands the output to write(cookie, data, n) as it comes */
+void png_utils_callback_sink(struct png_sink *sink,
+		int (*write)(void *cookie, const unsigned char *data, size_t n), void *cookie);
+
+/*
+ * Streaming PNG writer.  png_utils_begin() writes the header, then
+ * png_utils_write_rows() takes the h rows of 8-bit RGB or RGBA pixels, in
+ * as many calls as convenient, straight from the caller's buffers: nrows
+ * rows starting at rows, stride bytes apart (negative to go upwards).
+ * png_utils_end() finishes the image and frees the writer.  After an error
+ * every call does nothing, and png_utils_end() returns -1 with errno set.
+ */
+struct png_writer;
+
+struct png_writer *png_utils_begin(struct png_sink *sink, int w, int h, int has_alpha);
+int png_utils_write_rows(struct png_writer *pw, const unsigned char *rows, int nrows, ptrdiff_t stride);
+int png_utils_end(struct png_writer *pw);
+
+/* Writes a whole image, flipped upside down if invert is set.  Returns 0 on success. */
+int png_utils_write_png_sink(struct png_sink *sink, unsigned char *pixels, int w, int h,
+		int has_alpha, int invert);
 int png_utils_write_png_image(const char *filename, unsigned char *pixels, int w, int h, int has_alpha, int invert);
 
 char *png_utils_read_png_image(const char *filename, int flipVertical, int flipHorizontal,
@@ -0,0 +1,59 @@
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "rng.h"
+
+#define GOLDEN_GAMMA 0x9e3779b97f4a7c15ULL
+
+/* The SplitMix64 output function */
+static uint64_t mix64(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+void rng_init(struct rng *r, uint64_t seed)
+{
+	r->key = mix64(seed + GOLDEN_GAMMA);
+	r->counter = 0;
+}
+
+static uint64_t rng_next64(struct rng *r)
+{
+	return mix64(r->key + ++r->counter * GOLDEN_GAMMA);
+}
+
+uint32_t rng_next(struct rng *r)
+{
+	return (uint32_t) (rng_next64(r) >> 32);
+}
+
+int rng_int(struct rng *r)
+{
+	return (int) (rng_next(r) >> 1);
+}
+
+void rng_split(struct rng *r, struct rng *child)
+{
+	/* Mixed twice so that child keys don't line up with r's outputs */
+	child->key = mix64(rng_next64(r) ^ 0x5851f42d4c957f2dULL);
+	child->counter = 0;
+}
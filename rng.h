@@ -0,0 +1,53 @@
+#ifndef RNG_H__
+#define RNG_H__
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdint.h>
+
+/*
+ * A counter based random number generator.  The n-th number of a stream is
+ * a hash (the SplitMix64 finalizer) of the stream's key and n, so a stream is
+ * nothing but a key and a counter.  Streams don't share any state, behave the
+ * same on every platform, and child streams can be split off in O(1).
+ */
+struct rng {
+	uint64_t key;
+	uint64_t counter;
+};
+
+#define RNG_INT_MAX 0x7fffffff
+
+void rng_init(struct rng *r, uint64_t seed);
+
+/* The next 32 random bits */
+uint32_t rng_next(struct rng *r);
+
+/* Like rand(), 0 .. RNG_INT_MAX */
+int rng_int(struct rng *r);
+
+/*
+ * Starts child as a new stream, independent of r and of every other child
+ * split off r.  Advances r by one number.
+ */
+void rng_split(struct rng *r, struct rng *child);
+
+#endif
@@ -0,0 +1,174 @@
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <pthread.h>
+#include <string.h>
+
+#include "sobel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SOBEL_X86 1
+#include <immintrin.h>
+#endif
+
+static void sobel_span_scalar(const unsigned char *above, const unsigned char *row,
+		const unsigned char *below, int i1, int i2, short *dzdx, short *dzdy)
+{
+	int i;
+
+	for (i = i1; i < i2; i++) {
+		dzdx[i] = ((int) above[i - 1] - (int) above[i + 1]) +
+				3 * ((int) row[i - 1] - (int) row[i + 1]);
+		dzdy[i] = -((int) below[i - 1] - (int) above[i - 1]) -
+				3 * ((int) below[i] - (int) above[i]);
+	}
+}
+
+void sobel_row_scalar(const unsigned char *above, const unsigned char *row, const unsigned char *below,
+		int width, short *dzdx, short *dzdy)
+{
+	sobel_span_scalar(above, row, below, 1, width - 1, dzdx, dzdy);
+}
+
+#ifdef SOBEL_X86
+
+/* 16 pixels starting at i, 8 at a time */
+__attribute__((target("sse4.1")))
+static inline void sobel8_sse41(const unsigned char *above, const unsigned char *row,
+		const unsigned char *below, int i, short *dzdx, short *dzdy)
+{
+	const __m128i three = _mm_set1_epi16(3);
+	__m128i al, ac, ar, rl, rr, bl, bc, dx, dy;
+
+	al = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) &above[i - 1]));
+	ac = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) &above[i]));
+	ar = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) &above[i + 1]));
+	rl = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) &row[i - 1]));
+	rr = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) &row[i + 1]));
+	bl = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) &below[i - 1]));
+	bc = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) &below[i]));
+
+	dx = _mm_add_epi16(_mm_sub_epi16(al, ar), _mm_mullo_epi16(three, _mm_sub_epi16(rl, rr)));
+	dy = _mm_add_epi16(_mm_sub_epi16(al, bl), _mm_mullo_epi16(three, _mm_sub_epi16(ac, bc)));
+	_mm_storeu_si128((__m128i *) &dzdx[i], dx);
+	_mm_storeu_si128((__m128i *) &dzdy[i], dy);
+}
+
+__attribute__((target("sse4.1")))
+static void sobel_row_sse41(const unsigned char *above, const unsigned char *row,
+		const unsigned char *below, int width, short *dzdx, short *dzdy)
+{
+	int i;
+
+	/* 16 pixels per iteration, the last load reads up to row[i + 16] */
+	for (i = 1; i + 16 < width; i += 16) {
+		sobel8_sse41(above, row, below, i, dzdx, dzdy);
+		sobel8_sse41(above, row, below, i + 8, dzdx, dzdy);
+	}
+	sobel_span_scalar(above, row, below, i, width - 1, dzdx, dzdy);
+}
+
+/* 16 pixels starting at i */
+__attribute__((target("avx2")))
+static inline void sobel16_avx2(const unsigned char *above, const unsigned char *row,
+		const unsigned char *below, int i, short *dzdx, short *dzdy)
+{
+	const __m256i three = _mm256_set1_epi16(3);
+	__m256i al, ac, ar, rl, rr, bl, bc, dx, dy;
+
+	al = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &above[i - 1]));
+	ac = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &above[i]));
+	ar = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &above[i + 1]));
+	rl = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &row[i - 1]));
+	rr = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &row[i + 1]));
+	bl = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &below[i - 1]));
+	bc = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &below[i]));
+
+	dx = _mm256_add_epi16(_mm256_sub_epi16(al, ar), _mm256_mullo_epi16(three, _mm256_sub_epi16(rl, rr)));
+	dy = _mm256_add_epi16(_mm256_sub_epi16(al, bl), _mm256_mullo_epi16(three, _mm256_sub_epi16(ac, bc)));
+	_mm256_storeu_si256((__m256i *) &dzdx[i], dx);
+	_mm256_storeu_si256((__m256i *) &dzdy[i], dy);
+}
+
+__attribute__((target("avx2")))
+static void sobel_row_avx2(const unsigned char *above, const unsigned char *row,
+		const unsigned char *below, int width, short *dzdx, short *dzdy)
+{
+	int i;
+
+	/* 32 pixels per iteration, the last load reads up to row[i + 32] */
+	for (i = 1; i + 32 < width; i += 32) {
+		sobel16_avx2(above, row, below, i, dzdx, dzdy);
+		sobel16_avx2(above, row, below, i + 16, dzdx, dzdy);
+	}
+	sobel_span_scalar(above, row, below, i, width - 1, dzdx, dzdy);
+}
+
+#endif
+
+static sobel_row_fn sobel_impl;
+static const char *sobel_impl_name;
+static pthread_once_t sobel_once = PTHREAD_ONCE_INIT;
+
+static void sobel_choose_implementation(void)
+{
+#ifdef SOBEL_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		sobel_impl_name = "avx2";
+		sobel_impl = sobel_row_avx2;
+		return;
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		sobel_impl_name = "sse4.1";
+		sobel_impl = sobel_row_sse41;
+		return;
+	}
+#endif
+	sobel_impl_name = "scalar";
+	sobel_impl = sobel_row_scalar;
+}
+
+void sobel_row(const unsigned char *above, const unsigned char *row, const unsigned char *below,
+		int width, short *dzdx, short *dzdy)
+{
+	pthread_once(&sobel_once, sobel_choose_implementation);
+	sobel_impl(above, row, below, width, dzdx, dzdy);
+}
+
+const char *sobel_implementation(void)
+{
+	pthread_once(&sobel_once, sobel_choose_implementation);
+	return sobel_impl_name;
+}
+
+sobel_row_fn sobel_row_implementation(const char *name)
+{
+#ifdef SOBEL_X86
+	__builtin_cpu_init();
+	if (strcmp(name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2") ? sobel_row_avx2 : NULL;
+	if (strcmp(name, "sse4.1") == 0)
+		return __builtin_cpu_supports("sse4.1") ? sobel_row_sse41 : NULL;
+#endif
+	if (strcmp(name, "scalar") == 0)
+		return sobel_row_scalar;
+	return NULL;
+}
@@ -0,0 +1,53 @@
+#ifndef SOBEL_H__
+#define SOBEL_H__
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Height gradients of one row of an 8-bit heightmap, using the same weights
+ * as calculate_normal() in groovygreebler.c:
+ *
+ *   dzdx[i] =  (above[i - 1] - above[i + 1]) + 3 * (row[i - 1] - row[i + 1])
+ *   dzdy[i] = -(below[i - 1] - above[i - 1]) - 3 * (below[i] - above[i])
+ *
+ * Both are in the range -SOBEL_MAX_GRADIENT .. SOBEL_MAX_GRADIENT.  Only the
+ * interior pixels 1 .. width - 2 are computed, the caller deals with the
+ * edges, which need clamped neighbors.
+ */
+#define SOBEL_MAX_GRADIENT (4 * 255)
+
+void sobel_row(const unsigned char *above, const unsigned char *row, const unsigned char *below,
+		int width, short *dzdx, short *dzdy);
+
+/* The plain C version, regardless of what the cpu supports */
+void sobel_row_scalar(const unsigned char *above, const unsigned char *row, const unsigned char *below,
+		int width, short *dzdx, short *dzdy);
+
+/* Name of the implementation sobel_row() dispatches to: "avx2", "sse4.1" or "scalar" */
+const char *sobel_implementation(void);
+
+typedef void (*sobel_row_fn)(const unsigned char *above, const unsigned char *row,
+		const unsigned char *below, int width, short *dzdx, short *dzdy);
+
+/* The implementation called name, or NULL if this cpu can't run it, for comparing them */
+sobel_row_fn sobel_row_implementation(const char *name);
+
+#endif
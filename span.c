@@ -0,0 +1,95 @@
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "span.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static void span_add_saturated_scalar(unsigned char *p, int n, int h)
+{
+	int i, v;
+
+	for (i = 0; i < n; i++) {
+		v = p[i] + h;
+		if (v < 0)
+			v = 0;
+		else if (v > 255)
+			v = 255;
+		p[i] = v;
+	}
+}
+
+void span_add_saturated(unsigned char *p, int n, int h)
+{
+#ifdef __SSE2__
+	__m128i d, a, b, c, e;
+	int head;
+#endif
+
+	if (n <= 0 || h == 0)
+		return;
+	/* Anything beyond +/-255 saturates the same way */
+	if (h > 255)
+		h = 255;
+	else if (h < -255)
+		h = -255;
+#ifdef __SSE2__
+	if (n < 16) {
+		span_add_saturated_scalar(p, n, h);
+		return;
+	}
+	/* Up to the first 16 byte boundary one at a time, then whole aligned blocks */
+	head = (16 - ((unsigned long) p & 15)) & 15;
+	span_add_saturated_scalar(p, head, h);
+	p += head;
+	n -= head;
+	d = _mm_set1_epi8((char) (h > 0 ? h : -h));
+	if (h > 0) {
+		for (; n >= 64; p += 64, n -= 64) {
+			a = _mm_adds_epu8(_mm_load_si128((__m128i *) p), d);
+			b = _mm_adds_epu8(_mm_load_si128((__m128i *) (p + 16)), d);
+			c = _mm_adds_epu8(_mm_load_si128((__m128i *) (p + 32)), d);
+			e = _mm_adds_epu8(_mm_load_si128((__m128i *) (p + 48)), d);
+			_mm_store_si128((__m128i *) p, a);
+			_mm_store_si128((__m128i *) (p + 16), b);
+			_mm_store_si128((__m128i *) (p + 32), c);
+			_mm_store_si128((__m128i *) (p + 48), e);
+		}
+		for (; n >= 16; p += 16, n -= 16)
+			_mm_store_si128((__m128i *) p, _mm_adds_epu8(_mm_load_si128((__m128i *) p), d));
+	} else {
+		for (; n >= 64; p += 64, n -= 64) {
+			a = _mm_subs_epu8(_mm_load_si128((__m128i *) p), d);
+			b = _mm_subs_epu8(_mm_load_si128((__m128i *) (p + 16)), d);
+			c = _mm_subs_epu8(_mm_load_si128((__m128i *) (p + 32)), d);
+			e = _mm_subs_epu8(_mm_load_si128((__m128i *) (p + 48)), d);
+			_mm_store_si128((__m128i *) p, a);
+			_mm_store_si128((__m128i *) (p + 16), b);
+			_mm_store_si128((__m128i *) (p + 32), c);
+			_mm_store_si128((__m128i *) (p + 48), e);
+		}
+		for (; n >= 16; p += 16, n -= 16)
+			_mm_store_si128((__m128i *) p, _mm_subs_epu8(_mm_load_si128((__m128i *) p), d));
+	}
+#endif
+	span_add_saturated_scalar(p, n, h);
+}
@@ -0,0 +1,309 @@
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "bc.h"
+#include "threadpool.h"
+#include "trace.h"
+#include "texture.h"
+
+#define TEXTURE_BAND_ROWS 16 /* rows of blocks per job */
+#define TEXTURE_MAX_LEVELS 32
+
+#define DXGI_FORMAT_BC4_UNORM 80
+#define DXGI_FORMAT_BC5_UNORM 83
+#define VK_FORMAT_BC4_UNORM_BLOCK 139
+#define VK_FORMAT_BC5_UNORM_BLOCK 141
+#define KHR_DF_MODEL_BC4 131
+#define KHR_DF_MODEL_BC5 132
+
+/* One mip level: the pixels it's made from, and the blocks they become */
+struct texture_level {
+	const unsigned char *pixels;
+	int w, h, bpp;
+	int blocks_x, blocks_y;
+	unsigned char *blocks;
+	size_t size;
+};
+
+struct texture_job {
+	struct texture_level *level;
+	int channels;
+};
+
+int texture_container(const char *name)
+{
+	if (strcmp(name, "dds") == 0)
+		return TEXTURE_DDS;
+	if (strcmp(name, "ktx2") == 0)
+		return TEXTURE_KTX2;
+	return -1;
+}
+
+const char *texture_extension(int container)
+{
+	return container == TEXTURE_KTX2 ? "ktx2" : "dds";
+}
+
+static void encode_band(void *context, int band)
+{
+	struct texture_job *job = context;
+	struct texture_level *l = job->level;
+	int bx, by, by1, by2, c, i, j, x, y;
+	unsigned char values[16], *out;
+
+	trace_begin("texture", "bc_encode_band", "band", band);
+	by1 = band * TEXTURE_BAND_ROWS;
+	by2 = by1 + TEXTURE_BAND_ROWS < l->blocks_y ? by1 + TEXTURE_BAND_ROWS : l->blocks_y;
+	for (by = by1; by < by2; by++) {
+		for (bx = 0; bx < l->blocks_x; bx++) {
+			out = &l->blocks[((size_t) by * l->blocks_x + bx) * BC4_BLOCK_BYTES * job->channels];
+			for (c = 0; c < job->channels; c++) {
+				/* Blocks hanging over the edge repeat the last row and column */
+				for (j = 0; j < 4; j++) {
+					y = by * 4 + j < l->h ? by * 4 + j : l->h - 1;
+					for (i = 0; i < 4; i++) {
+						x = bx * 4 + i < l->w ? bx * 4 + i : l->w - 1;
+						values[j * 4 + i] = l->pixels[((size_t) y * l->w + x) * l->bpp + c];
+					}
+				}
+				bc4_encode_block(values, out + c * BC4_BLOCK_BYTES);
+			}
+		}
+	}
+	trace_end("texture", "bc_encode_band");
+}
+
+/*
+ * The next level down from l, with just the channels, averaging 2x2
+ * pixels.  Normal map levels are averaged like anything else and not
+ * renormalized, which is what most offline tools do by default too.
+ */
+static unsigned char *make_mip(struct texture_level *l, int channels, int w, int h)
+{
+	unsigned char *mip, *p;
+	int x, y, x1, y1, c;
+	size_t i00, i01, i10, i11;
+
+	mip = malloc((size_t) w * h * channels);
+	if (!mip)
+		return NULL;
+	p = mip;
+	for (y = 0; y < h; y++) {
+		y1 = 2 * y + 1 < l->h ? 2 * y + 1 : l->h - 1;
+		for (x = 0; x < w; x++) {
+			x1 = 2 * x + 1 < l->w ? 2 * x + 1 : l->w - 1;
+			i00 = ((size_t) 2 * y * l->w + 2 * x) * l->bpp;
+			i01 = ((size_t) 2 * y * l->w + x1) * l->bpp;
+			i10 = ((size_t) y1 * l->w + 2 * x) * l->bpp;
+			i11 = ((size_t) y1 * l->w + x1) * l->bpp;
+			for (c = 0; c < channels; c++)
+				*p++ = (l->pixels[i00 + c] + l->pixels[i01 + c] +
+					l->pixels[i10 + c] + l->pixels[i11 + c] + 2) / 4;
+		}
+	}
+	return mip;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+	put_le32(p, v);
+	put_le32(p + 4, v >> 32);
+}
+
+/* DDS_HEADER (see the DirectX docs) and DDS_HEADER_DXT10, after the magic */
+static int write_dds(FILE *f, struct texture_level *level, int nlevels, int channels)
+{
+	unsigned char h[4 + 124 + 20];
+	int i;
+
+	memset(h, 0, sizeof(h));
+	memcpy(h, "DDS ", 4);
+	put_le32(h + 4, 124);
+	/* caps, height, width, pixel format, linear size, and mipmap count */
+	put_le32(h + 8, 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000 | (nlevels > 1 ? 0x20000 : 0));
+	put_le32(h + 12, level[0].h);
+	put_le32(h + 16, level[0].w);
+	put_le32(h + 20, level[0].size);
+	put_le32(h + 28, nlevels);
+	put_le32(h + 76, 32); /* DDS_PIXELFORMAT */
+	put_le32(h + 80, 0x4); /* FourCC */
+	memcpy(h + 84, "DX10", 4);
+	/* texture, and if there are mipmaps, complex and mipmap */
+	put_le32(h + 108, 0x1000 | (nlevels > 1 ? 0x8 | 0x400000 : 0));
+	put_le32(h + 128, channels == 1 ? DXGI_FORMAT_BC4_UNORM : DXGI_FORMAT_BC5_UNORM);
+	put_le32(h + 132, 3); /* 2D texture */
+	put_le32(h + 140, 1); /* array size */
+	if (fwrite(h, sizeof(h), 1, f) != 1)
+		return -1;
+	for (i = 0; i < nlevels; i++)
+		if (fwrite(level[i].blocks, level[i].size, 1, f) != 1)
+			return -1;
+	return 0;
+}
+
+/*
+ * KTX 2.0: header, index, level index, data format descriptor, then the
+ * levels, smallest first, each aligned to a block.
+ */
+static int write_ktx2(FILE *f, struct texture_level *level, int nlevels, int channels)
+{
+	static const unsigned char identifier[12] = {
+		0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n',
+	};
+	unsigned char h[80 + 24 * TEXTURE_MAX_LEVELS + 64], *p, zero[16] = { 0 };
+	size_t block = BC4_BLOCK_BYTES * channels, dfd, dfd_size, offset, hsize;
+	size_t level_offset[TEXTURE_MAX_LEVELS];
+	int i, s;
+
+	dfd = 80 + 24 * nlevels;
+	dfd_size = 4 + 24 + 16 * channels;
+	hsize = dfd + dfd_size;
+
+	offset = hsize;
+	for (i = nlevels - 1; i >= 0; i--) {
+		offset = (offset + block - 1) / block * block;
+		level_offset[i] = offset;
+		offset += level[i].size;
+	}
+
+	memset(h, 0, sizeof(h));
+	memcpy(h, identifier, sizeof(identifier));
+	put_le32(h + 12, channels == 1 ? VK_FORMAT_BC4_UNORM_BLOCK : VK_FORMAT_BC5_UNORM_BLOCK);
+	put_le32(h + 16, 1); /* type size */
+	put_le32(h + 20, level[0].w);
+	put_le32(h + 24, level[0].h);
+	put_le32(h + 36, 1); /* faces */
+	put_le32(h + 40, nlevels);
+	put_le32(h + 48, dfd);
+	put_le32(h + 52, dfd_size);
+	for (i = 0; i < nlevels; i++) {
+		put_le64(h + 80 + 24 * i, level_offset[i]);
+		put_le64(h + 80 + 24 * i + 8, level[i].size);
+		put_le64(h + 80 + 24 * i + 16, level[i].size);
+	}
+
+	/* A basic descriptor block with a 64-bit sample per channel */
+	p = h + dfd;
+	put_le32(p, dfd_size);
+	put_le32(p + 8, 2 | (24 + 16 * channels) << 16); /* version 1.3, block size */
+	/* model, BT.709 primaries, linear transfer, straight alpha */
+	put_le32(p + 12, (channels == 1 ? KHR_DF_MODEL_BC4 : KHR_DF_MODEL_BC5) | 1 << 8 | 1 << 16);
+	put_le32(p + 16, 3 | 3 << 8); /* 4x4 texel blocks */
+	put_le32(p + 20, block); /* bytes in plane 0 */
+	for (s = 0; s < channels; s++) {
+		put_le32(p + 28 + 16 * s, 64 * s | 63 << 16 | s << 24);
+		put_le32(p + 28 + 16 * s + 12, 0xffffffff);
+	}
+
+	if (fwrite(h, hsize, 1, f) != 1)
+		return -1;
+	offset = hsize;
+	for (i = nlevels - 1; i >= 0; i--) {
+		if (level_offset[i] > offset &&
+			fwrite(zero, level_offset[i] - offset, 1, f) != 1)
+			return -1;
+		if (fwrite(level[i].blocks, level[i].size, 1, f) != 1)
+			return -1;
+		offset = level_offset[i] + level[i].size;
+	}
+	return 0;
+}
+
+int texture_write(struct threadpool *pool, const char *filename, int container,
+		const unsigned char *pixels, int w, int h, int bpp, int channels, int mipmaps)
+{
+	struct texture_level level[TEXTURE_MAX_LEVELS];
+	struct texture_job job;
+	int i, nlevels = 0, rc = -1, error = ENOMEM;
+	FILE *f = NULL;
+
+	if (w <= 0 || h <= 0 || (channels != 1 && channels != 2) || bpp < channels) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(level, 0, sizeof(level));
+	level[0].pixels = pixels;
+	level[0].w = w;
+	level[0].h = h;
+	level[0].bpp = bpp;
+	for (nlevels = 1; mipmaps && nlevels < TEXTURE_MAX_LEVELS; nlevels++) {
+		struct texture_level *l = &level[nlevels], *prev = &level[nlevels - 1];
+
+		if (prev->w == 1 && prev->h == 1)
+			break;
+		l->w = prev->w > 1 ? prev->w / 2 : 1;
+		l->h = prev->h > 1 ? prev->h / 2 : 1;
+		l->bpp = channels;
+		l->pixels = make_mip(prev, channels, l->w, l->h);
+		if (!l->pixels)
+			goto out;
+	}
+
+	job.channels = channels;
+	for (i = 0; i < nlevels; i++) {
+		level[i].blocks_x = (level[i].w + 3) / 4;
+		level[i].blocks_y = (level[i].h + 3) / 4;
+		level[i].size = (size_t) level[i].blocks_x * level[i].blocks_y * BC4_BLOCK_BYTES * channels;
+		level[i].blocks = malloc(level[i].size);
+		if (!level[i].blocks)
+			goto out;
+		job.level = &level[i];
+		threadpool_parallel_for(pool, (level[i].blocks_y + TEXTURE_BAND_ROWS - 1) / TEXTURE_BAND_ROWS,
+					encode_band, &job);
+	}
+
+	f = fopen(filename, "w");
+	if (!f) {
+		error = errno;
+		goto out;
+	}
+	if (container == TEXTURE_KTX2)
+		rc = write_ktx2(f, level, nlevels, channels);
+	else
+		rc = write_dds(f, level, nlevels, channels);
+	error = errno;
+	if (fclose(f) && !rc) {
+		error = errno;
+		rc = -1;
+	}
+out:
+	for (i = 0; i < nlevels; i++) {
+		if (i > 0)
+			free((void *) level[i].pixels);
+		free(level[i].blocks);
+	}
+	if (rc)
+		errno = error;
+	return rc;
+}
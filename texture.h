@@ -0,0 +1,52 @@
+#ifndef TEXTURE_H__
+#define TEXTURE_H__
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Block compressed textures, in DDS (with the DX10 header) or KTX2
+ * files: BC4 for one channel, BC5 for two.  Blocks are encoded in
+ * parallel, in bands of block rows.
+ */
+struct threadpool;
+
+enum texture_container {
+	TEXTURE_DDS,
+	TEXTURE_KTX2,
+};
+
+/* The container called name, "dds" or "ktx2", or -1 if there's no such thing */
+int texture_container(const char *name);
+
+/* The file name extension for container, without the dot */
+const char *texture_extension(int container);
+
+/*
+ * Writes a w x h image to filename: BC4 from the first byte of each pixel
+ * if channels is 1, BC5 from the first two if it's 2.  Pixels are bpp
+ * bytes apart.  With mipmaps, every smaller level down to 1x1 follows,
+ * each a 2x2 box filtered half of the one before.  Returns 0 on success,
+ * or -1 with errno set.
+ */
+int texture_write(struct threadpool *pool, const char *filename, int container,
+		const unsigned char *pixels, int w, int h, int bpp, int channels, int mipmaps);
+
+#endif
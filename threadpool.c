@@ -0,0 +1,327 @@
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+
+struct threadpool_task {
+	threadpool_task_fn fn;
+	void *arg;
+};
+
+/* A circular buffer of tasks, the owner works at the tail, thieves at the head */
+struct task_deque {
+	pthread_mutex_t lock;
+	struct threadpool_task *task;
+	int head, count, size;
+};
+
+struct threadpool {
+	int nthreads; /* including the calling thread */
+	pthread_t *thread;
+	struct task_deque *deque; /* one per worker */
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup; /* tasks were queued, or the last pending task finished */
+	int sleepers;
+	int queued; /* tasks sitting in deques */
+	int pending; /* tasks submitted and not yet finished */
+	int shutdown;
+};
+
+struct worker {
+	struct threadpool *pool;
+	int index;
+};
+
+static __thread struct threadpool *current_pool;
+static __thread int current_worker;
+
+static void deque_push(struct task_deque *d, struct threadpool_task *t)
+{
+	struct threadpool_task *newtask;
+	int i;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->count == d->size) {
+		newtask = malloc(sizeof(*newtask) * (d->size ? d->size * 2 : 64));
+		if (!newtask) {
+			fprintf(stderr, "Out of memory queueing task\n");
+			exit(1);
+		}
+		for (i = 0; i < d->count; i++)
+			newtask[i] = d->task[(d->head + i) % d->size];
+		free(d->task);
+		d->task = newtask;
+		d->head = 0;
+		d->size = d->size ? d->size * 2 : 64;
+	}
+	d->task[(d->head + d->count) % d->size] = *t;
+	d->count++;
+	pthread_mutex_unlock(&d->lock);
+}
+
+static int deque_pop_tail(struct task_deque *d, struct threadpool_task *t)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->count) {
+		d->count--;
+		*t = d->task[(d->head + d->count) % d->size];
+		found = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+static int deque_steal_head(struct task_deque *d, struct threadpool_task *t)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->count) {
+		*t = d->task[d->head];
+		d->head = (d->head + 1) % d->size;
+		d->count--;
+		found = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+static int find_task(struct threadpool *pool, int me, struct threadpool_task *t)
+{
+	int i;
+
+	if (deque_pop_tail(&pool->deque[me], t))
+		goto found;
+	for (i = 1; i < pool->nthreads; i++)
+		if (deque_steal_head(&pool->deque[(me + i) % pool->nthreads], t))
+			goto found;
+	return 0;
+found:
+	__sync_fetch_and_sub(&pool->queued, 1);
+	return 1;
+}
+
+static void run_task(struct threadpool *pool, struct threadpool_task *t)
+{
+	t->fn(t->arg);
+	if (__sync_sub_and_fetch(&pool->pending, 1) == 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->wakeup);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct threadpool *pool = w->pool;
+	struct threadpool_task t;
+
+	current_pool = pool;
+	current_worker = w->index;
+	free(w);
+
+	for (;;) {
+		if (find_task(pool, current_worker, &t)) {
+			run_task(pool, &t);
+			continue;
+		}
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->shutdown && pool->queued == 0) {
+			pool->sleepers++;
+			pthread_cond_wait(&pool->wakeup, &pool->lock);
+			pool->sleepers--;
+		}
+		if (pool->shutdown) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+struct threadpool *threadpool_create(int nthreads)
+{
+	struct threadpool *pool;
+	struct worker *w;
+	int i, rc;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	pool = malloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+	memset(pool, 0, sizeof(*pool));
+	pool->nthreads = nthreads;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wakeup, NULL);
+
+	pool->thread = malloc(sizeof(*pool->thread) * nthreads);
+	pool->deque = malloc(sizeof(*pool->deque) * nthreads);
+	if (!pool->thread || !pool->deque) {
+		free(pool->thread);
+		free(pool->deque);
+		free(pool);
+		return NULL;
+	}
+	memset(pool->deque, 0, sizeof(*pool->deque) * nthreads);
+	for (i = 0; i < nthreads; i++)
+		pthread_mutex_init(&pool->deque[i].lock, NULL);
+
+	/* The calling thread is worker 0, so only nthreads - 1 threads are started */
+	current_pool = pool;
+	current_worker = 0;
+	for (i = 1; i < nthreads; i++) {
+		w = malloc(sizeof(*w));
+		rc = -1;
+		if (w) {
+			w->pool = pool;
+			w->index = i;
+			rc = pthread_create(&pool->thread[i], NULL, worker_thread, w);
+		}
+		if (rc) {
+			fprintf(stderr, "Failed to start worker thread %d\n", i);
+			free(w);
+			pool->nthreads = i;
+			break;
+		}
+	}
+	return pool;
+}
+
+int threadpool_nthreads(struct threadpool *pool)
+{
+	return pool->nthreads;
+}
+
+void threadpool_submit(struct threadpool *pool, threadpool_task_fn fn, void *arg)
+{
+	struct threadpool_task t;
+	int me = current_pool == pool ? current_worker : 0;
+
+	t.fn = fn;
+	t.arg = arg;
+	__sync_fetch_and_add(&pool->pending, 1);
+	deque_push(&pool->deque[me], &t);
+	__sync_fetch_and_add(&pool->queued, 1);
+	pthread_mutex_lock(&pool->lock);
+	if (pool->sleepers)
+		pthread_cond_signal(&pool->wakeup);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void threadpool_wait(struct threadpool *pool)
+{
+	struct threadpool_task t;
+
+	for (;;) {
+		if (find_task(pool, 0, &t)) {
+			run_task(pool, &t);
+			continue;
+		}
+		pthread_mutex_lock(&pool->lock);
+		if (pool->pending == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		if (pool->queued == 0) {
+			pool->sleepers++;
+			pthread_cond_wait(&pool->wakeup, &pool->lock);
+			pool->sleepers--;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+struct parallel_for_batch {
+	threadpool_job_fn fn;
+	void *context;
+	int njobs;
+	int next_job;
+};
+
+/* One of these runs on each worker, claiming jobs until there are none left */
+static void parallel_for_runner(void *arg)
+{
+	struct parallel_for_batch *b = arg;
+	int job;
+
+	for (;;) {
+		job = __sync_fetch_and_add(&b->next_job, 1);
+		if (job >= b->njobs)
+			break;
+		b->fn(b->context, job);
+	}
+}
+
+void threadpool_parallel_for(struct threadpool *pool, int njobs, threadpool_job_fn fn, void *context)
+{
+	struct parallel_for_batch b;
+	int i;
+
+	if (pool->nthreads == 1 || njobs <= 1) {
+		for (i = 0; i < njobs; i++)
+			fn(context, i);
+		return;
+	}
+
+	b.fn = fn;
+	b.context = context;
+	b.njobs = njobs;
+	b.next_job = 0;
+	for (i = 0; i < pool->nthreads && i < njobs; i++)
+		threadpool_submit(pool, parallel_for_runner, &b);
+	threadpool_wait(pool);
+}
+
+void threadpool_destroy(struct threadpool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->wakeup);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 1; i < pool->nthreads; i++)
+		pthread_join(pool->thread[i], NULL);
+	for (i = 0; i < pool->nthreads; i++) {
+		pthread_mutex_destroy(&pool->deque[i].lock);
+		free(pool->deque[i].task);
+	}
+	pthread_cond_destroy(&pool->wakeup);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->deque);
+	free(pool->thread);
+	free(pool);
+}
@@ -0,0 +1,57 @@
+#ifndef THREADPOOL_H__
+#define THREADPOOL_H__
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * A small work stealing pool of worker threads.  Each worker has its own
+ * deque of tasks; it runs the most recently queued of its own tasks first
+ * and, when it runs out, steals the oldest task from another worker.  Tasks
+ * may submit more tasks.  The thread that created the pool is worker 0 and
+ * only does work while it is inside threadpool_wait() or
+ * threadpool_parallel_for(), which must only be called from that thread.
+ */
+
+struct threadpool;
+
+typedef void (*threadpool_task_fn)(void *arg);
+typedef void (*threadpool_job_fn)(void *context, int job);
+
+/* nthreads <= 0 means one thread per online cpu */
+struct threadpool *threadpool_create(int nthreads);
+int threadpool_nthreads(struct threadpool *pool);
+
+/* Queue fn(arg) to be run by some worker, may be called from within a task */
+void threadpool_submit(struct threadpool *pool, threadpool_task_fn fn, void *arg);
+
+/* Run tasks until every submitted task, including ones submitted by tasks, is done */
+void threadpool_wait(struct threadpool *pool);
+
+/*
+ * Runs fn(context, job) for every job in 0 .. njobs - 1 and waits for all of
+ * them.  Jobs are claimed by whichever worker is free, so the caller must not
+ * depend on the order in which they run.
+ */
+void threadpool_parallel_for(struct threadpool *pool, int njobs, threadpool_job_fn fn, void *context);
+
+void threadpool_destroy(struct threadpool *pool);
+
+#endif
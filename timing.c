@@ -0,0 +1,120 @@
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "timing.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TIMING_TSC 1
+#include <x86intrin.h>
+#endif
+
+double wall_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+uint64_t cycle_counter(void)
+{
+#ifdef TIMING_TSC
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+const char *cycle_counter_unit(void)
+{
+#ifdef TIMING_TSC
+	return "cycles";
+#else
+	return "ns";
+#endif
+}
+
+long peak_rss_kb(void)
+{
+	char line[256];
+	long kb = -1;
+	FILE *f;
+
+	f = fopen("/proc/self/status", "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+			break;
+	fclose(f);
+	return kb;
+}
+
+int reset_peak_rss(void)
+{
+	FILE *f;
+	int rc;
+
+	/* See proc(5), writing 5 to clear_refs resets VmHWM */
+	f = fopen("/proc/self/clear_refs", "w");
+	if (!f)
+		return -1;
+	rc = fputs("5", f) < 0;
+	if (fclose(f))
+		rc = 1;
+	return rc ? -1 : 0;
+}
+
+void stage_log_init(struct stage_log *log)
+{
+	memset(log, 0, sizeof(*log));
+}
+
+void stage_begin(struct stage_log *log, const char *name)
+{
+	struct stage *s;
+
+	if (!log || log->nstages >= MAX_STAGES)
+		return;
+	s = &log->stage[log->nstages];
+	s->name = name;
+	s->seconds = 0.0;
+	s->peak_rss_kb = -1;
+	reset_peak_rss();
+	s->start = wall_time();
+}
+
+void stage_end(struct stage_log *log)
+{
+	struct stage *s;
+
+	if (!log || log->nstages >= MAX_STAGES)
+		return;
+	s = &log->stage[log->nstages++];
+	s->seconds = wall_time() - s->start;
+	s->peak_rss_kb = peak_rss_kb();
+}
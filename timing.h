@@ -0,0 +1,67 @@
+#ifndef TIMING_H__
+#define TIMING_H__
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdint.h>
+
+/*
+ * Wall time and peak memory of the stages of a run.  A stage_log holds the
+ * stages in the order they were run; stage_begin() starts the next one and
+ * stage_end() finishes the current one.
+ */
+#define MAX_STAGES 16
+
+struct stage {
+	const char *name;
+	double start, seconds;
+	long peak_rss_kb; /* highest resident set size during the stage, -1 if unknown */
+};
+
+struct stage_log {
+	int nstages;
+	struct stage stage[MAX_STAGES];
+};
+
+void stage_log_init(struct stage_log *log);
+void stage_begin(struct stage_log *log, const char *name);
+void stage_end(struct stage_log *log);
+
+/* Seconds from some fixed point in the past */
+double wall_time(void);
+
+/*
+ * A cheap, fine grained tick count for timing short kernels: the time stamp
+ * counter on x86, which ticks at a constant rate near the nominal clock
+ * speed, and nanoseconds elsewhere.  cycle_counter_unit() says which.
+ */
+uint64_t cycle_counter(void);
+const char *cycle_counter_unit(void);
+
+/*
+ * The kernel's high water mark of resident memory for this process, in kB,
+ * and a way to reset it to the current resident size, which is what makes
+ * per stage peaks possible.  Both return -1 where they aren't supported.
+ */
+long peak_rss_kb(void);
+int reset_peak_rss(void);
+
+#endif
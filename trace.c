@@ -0,0 +1,132 @@
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "timing.h"
+#include "trace.h"
+
+struct trace_event {
+	const char *category, *name, *arg_name;
+	long arg;
+	double ts; /* microseconds since trace_open() */
+	int tid;
+	char phase; /* 'B' or 'E' */
+};
+
+static char *trace_filename;
+static double trace_start;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_event *events;
+static int nevents, events_size;
+static int nthreads;
+static __thread int trace_tid = -1;
+
+int trace_open(const char *filename)
+{
+	trace_filename = strdup(filename);
+	if (!trace_filename)
+		return -1;
+	trace_start = wall_time();
+	return 0;
+}
+
+static void trace_event(char phase, const char *category, const char *name, const char *arg_name, long arg)
+{
+	struct trace_event *e;
+	double ts;
+
+	if (!trace_filename)
+		return;
+	ts = (wall_time() - trace_start) * 1e6;
+	pthread_mutex_lock(&trace_lock);
+	if (trace_tid < 0)
+		trace_tid = nthreads++;
+	if (nevents == events_size) {
+		e = realloc(events, sizeof(*e) * (events_size ? events_size * 2 : 4096));
+		if (!e) {
+			pthread_mutex_unlock(&trace_lock);
+			return;
+		}
+		events = e;
+		events_size = events_size ? events_size * 2 : 4096;
+	}
+	e = &events[nevents++];
+	e->phase = phase;
+	e->category = category;
+	e->name = name;
+	e->arg_name = arg_name;
+	e->arg = arg;
+	e->ts = ts;
+	e->tid = trace_tid;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_begin(const char *category, const char *name, const char *arg_name, long arg)
+{
+	trace_event('B', category, name, arg_name, arg);
+}
+
+void trace_end(const char *category, const char *name)
+{
+	trace_event('E', category, name, NULL, 0);
+}
+
+int trace_close(void)
+{
+	struct trace_event *e;
+	FILE *f;
+	int i, rc;
+
+	if (!trace_filename)
+		return 0;
+	f = fopen(trace_filename, "w");
+	if (!f)
+		goto out;
+	/* The threads get names, then come the events */
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+		"\"args\": {\"name\": \"main\"}}");
+	for (i = 1; i < nthreads; i++)
+		fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+			"\"args\": {\"name\": \"thread %d\"}}", i, i);
+	for (i = 0; i < nevents; i++) {
+		e = &events[i];
+		fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, "
+			"\"pid\": 1, \"tid\": %d", e->name, e->category, e->phase, e->ts, e->tid);
+		if (e->arg_name)
+			fprintf(f, ", \"args\": {\"%s\": %ld}", e->arg_name, e->arg);
+		fprintf(f, "}");
+	}
+	fprintf(f, "\n]}\n");
+out:
+	rc = (!f || ferror(f)) ? -1 : 0;
+	if (f && fclose(f))
+		rc = -1;
+	free(events);
+	events = NULL;
+	nevents = events_size = 0;
+	free(trace_filename);
+	trace_filename = NULL;
+	return rc;
+}
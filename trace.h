@@ -0,0 +1,43 @@
+#ifndef TRACE_H__
+#define TRACE_H__
+/*
+	Copyright (C) 2019 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of groovygreebler.
+
+	groovygreebler is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	groovygreebler is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with groovygreebler; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Timelines in the Chrome trace event format, for chrome://tracing or
+ * Perfetto.  Once trace_open() is called, trace_begin() and trace_end()
+ * record the start and end of a span of work on the calling thread, and
+ * trace_close() writes them all out.  Spans on one thread must nest.
+ * Threads are numbered in the order they first record something.
+ *
+ * Without trace_open() all of these return right away, so they can be
+ * left in place around anything coarser than a few microseconds.
+ */
+int trace_open(const char *filename);
+
+/* arg_name and arg are shown with the span, arg_name may be NULL */
+void trace_begin(const char *category, const char *name, const char *arg_name, long arg);
+void trace_end(const char *category, const char *name);
+
+/* Returns 0 on success, -1 with errno set if the file couldn't be written */
+int trace_close(void);
+
+#endif